@@ -67,14 +67,34 @@ namespace
 
       size_t finish( void *out_buff )
       {
-         int   out_size;
-         auto  ret = EVP_CipherFinal_ex( _ctx, static_cast< unsigned char * >( out_buff ), &out_size );
-         ssl_ensure( ret );
+         size_t   out_size;
+         auto     succ = try_finish( out_buff, out_size );
+         ssl_ensure( succ );
+
+         return out_size;
+      }
+
+
+      /**
+       * 与 finish 相同, 但填充校验失败时返回 false, 而不是中止程序
+       */
+      bool try_finish( void *out_buff, size_t &out_size )
+      {
+         int   size;
+         auto  ret = EVP_CipherFinal_ex( _ctx, static_cast< unsigned char * >( out_buff ), &size );
+
+         if ( ret == 0 )
+         {
+            ERR_clear_error( );
+            EVP_CIPHER_CTX_reset( _ctx );
+            return false;
+         }
 
          ret = EVP_CIPHER_CTX_cleanup( _ctx );
          ssl_ensure( ret );
 
-         return static_cast< unsigned >( out_size );
+         out_size = static_cast< unsigned >( size );
+         return true;
       }
 
 
@@ -84,7 +104,10 @@ namespace
 }
 
 
-static Aes_cbc_ctx aes;
+/**
+ * 每个线程一个上下文, 允许多线程同时解密 (见 omp_rebuild)
+ */
+static thread_local Aes_cbc_ctx aes;
 
 
 
@@ -98,7 +121,10 @@ static void aes_first_block_by_passwd( uint8_t *out, const uint8_t *in, bool enc
 
 
 
-static size_t aes_cbc( const uint8_t *key, const uint8_t *iv, uint8_t *out_buff, const uint8_t *in_buff, size_t in_size, bool enc )
+/**
+ * soft 为 true 时, 解密的填充校验失败返回 SIZE_MAX, 否则中止程序
+ */
+static size_t aes_cbc( const uint8_t *key, const uint8_t *iv, uint8_t *out_buff, const uint8_t *in_buff, size_t in_size, bool enc, bool soft = false )
 {
    aes.reset( EVP_aes_128_cbc( ), key, iv, enc );
 
@@ -114,9 +140,15 @@ static size_t aes_cbc( const uint8_t *key, const uint8_t *iv, uint8_t *out_buff,
    }
 
    size += aes.update( out_buff, in_buff, in_size );
-   size += aes.finish( out_buff + size );
 
-   return size;
+   if ( !soft )
+      return size + aes.finish( out_buff + size );
+
+   size_t  tail;
+   if ( !aes.try_finish( out_buff + size, tail ) )
+      return SIZE_MAX;
+
+   return size + tail;
 }
 
 
@@ -148,11 +180,8 @@ size_t aes_encrypt( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size )
 
 
 
-size_t aes_decrypt( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size )
+static size_t aes_decrypt( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size, bool soft )
 {
-   ensure( in_size >= 48 );
-   ensure( ( in_size % 16 ) == 0 );
-
    uint8_t  key[16];
    memcpy( key, in_buff, 16 );
 
@@ -161,6 +190,106 @@ size_t aes_decrypt( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size )
    for ( size_t i = 0; i < 16; ++i )
       key[i] ^= out_buff[i];
 
-   auto  size = aes_cbc( key, out_buff, out_buff + 16, in_buff + 16, in_size - 16, false );
+   auto  size = aes_cbc( key, out_buff, out_buff + 16, in_buff + 16, in_size - 16, false, soft );
+   if ( size == SIZE_MAX )
+      return SIZE_MAX;
+
    return size + 16;
 }
+
+
+
+size_t aes_decrypt( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size )
+{
+   ensure( in_size >= 48 );
+   ensure( ( in_size % 16 ) == 0 );
+
+   return aes_decrypt( out_buff, in_buff, in_size, false );
+}
+
+
+
+/**
+ * 带校验的加密
+ *
+ * 在原文前加上原文的 SHA3-256 摘要后整体加密, 摘要同时作为首块, 使得相同前缀的不同原文得到不同的密文
+ * out 与 in 可以相同, out 的空间至少需要 size + 32 + 16 字节
+ */
+size_t aes_seal( uint8_t *out_buff, const uint8_t *in_buff, size_t size )
+{
+   uint8_t  md[32];
+   sha3_256( md, in_buff, size );
+
+   memmove( out_buff + 32, in_buff, size );
+   memcpy( out_buff, md, 32 );
+
+   return aes_encrypt( out_buff, out_buff, size + 32 );
+}
+
+
+
+/**
+ * 解密 aes_seal 的输出并校验, 原文写到 out 的开头
+ * 密文损坏时不中止程序, 而是返回 SIZE_MAX, 由调用者决定如何处理
+ */
+size_t aes_unseal( uint8_t *out_buff, const uint8_t *in_buff, size_t in_size )
+{
+   if ( ( in_size < 48 ) || ( ( in_size % 16 ) != 0 ) )
+      return SIZE_MAX;
+
+   auto  size = aes_decrypt( out_buff, in_buff, in_size, true );
+   if ( ( size == SIZE_MAX ) || ( size < 32 ) )
+      return SIZE_MAX;
+
+   size -= 32;
+
+   uint8_t  md[32];
+   sha3_256( md, out_buff + 32, size );
+   if ( memcmp( md, out_buff, 32 ) != 0 )
+      return SIZE_MAX;
+
+   memmove( out_buff, out_buff + 32, size );
+   return size;
+}
+
+
+
+/**
+ * 只解密 aes_encrypt 输出的首尾部分
+ *
+ * head 得到原文的前 32 字节, tail 得到原文 (去掉填充后) 的最后 16 字节
+ * 首块之后是 CBC, 任一块只需要它自己和前一块密文即可解密, 所以只需解密 4 块, 与密文长度无关
+ * 填充校验失败时返回 false
+ */
+bool aes_decrypt_edge( uint8_t *head, uint8_t *tail, const uint8_t *in_buff, size_t in_size )
+{
+   if ( ( in_size < 48 ) || ( ( in_size % 16 ) != 0 ) )
+      return false;
+
+   uint8_t  buff[64];
+   uint8_t  key[16];
+
+   crypt_first_block( buff, in_buff, false );
+   memcpy( head, buff, 16 );
+
+   for ( size_t i = 0; i < 16; ++i )
+      key[i] = in_buff[i] ^ head[i];
+
+   // 解密时最后一块留给 finish 处理填充, 所以输入两块, 只得到第一块
+   aes.reset( EVP_aes_128_cbc( ), key, head, false );
+
+   auto  sz = aes.update( buff, in_buff + 16, 32 );
+   ensure( sz == 16 );
+   memcpy( head + 16, buff, 16 );
+
+   // 最后两块, 以其前一块密文为 iv, 同时校验填充
+   auto  last = in_buff + in_size - 32;
+   auto  iv   = ( in_size == 48 ) ? head : last - 16;
+
+   sz = aes_cbc( key, iv, buff, last, 32, false, true );
+   if ( ( sz == SIZE_MAX ) || ( sz < 16 ) )
+      return false;
+
+   memcpy( tail, buff + sz - 16, 16 );
+   return true;
+}
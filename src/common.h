@@ -19,10 +19,13 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <list>
+#include <map>
 #include <ranges>
 #include <span>
 #include <string_view>
@@ -58,9 +61,15 @@ extern const char      *remote_name;
 extern const char      *remote_url;
 
 extern git_repository  *repo;
+extern git_repository  *xrepo;
 extern git_odb         *odb;
+extern git_odb         *plain_odb;
 extern git_remote      *remote;
 
+extern bool             pack_mode;
+extern bool             omp_snapshot;
+extern bool             cloning;
+
 extern int              log_indent;
 
 
@@ -223,6 +232,26 @@ int  system( const std::list< std::string > & );
 
 
 
+/**
+ * 进程间的文件锁 (flock), 无法建立锁文件时 (例如只读的仓库) 不加锁
+ *
+ * flock 的锁属于打开的文件, 同一进程中不能嵌套使用同一个锁文件
+ */
+class File_lock
+{
+public:
+   File_lock( const std::filesystem::path &, bool exclusive );
+   ~File_lock( );
+
+   File_lock( const File_lock & ) = delete;
+   File_lock & operator = ( const File_lock & ) = delete;
+
+private:
+   int   _fd;
+};
+
+
+
 class Pipe
 {
 public:
@@ -264,7 +293,9 @@ struct std::hash< git_oid >
 {
    size_t operator ( ) ( const git_oid &oid ) const
    {
-      return *reinterpret_cast< const size_t * >( oid.id );
+      size_t   h;
+      memcpy( &h, oid.id, sizeof( h ) );
+      return h;
    }
 };
 
@@ -460,6 +491,9 @@ inline void sha3_256( uint8_t (&md)[32], const auto &...args ) requires ( sizeof
 
 size_t aes_encrypt( uint8_t *, const uint8_t *, size_t );
 size_t aes_decrypt( uint8_t *, const uint8_t *, size_t );
+size_t aes_seal( uint8_t *, const uint8_t *, size_t );
+size_t aes_unseal( uint8_t *, const uint8_t *, size_t );
+bool aes_decrypt_edge( uint8_t *, uint8_t *, const uint8_t *, size_t );
 
 
 
@@ -520,6 +554,16 @@ struct Raw_oid
       return oid;
    }
 
+   int cmp( const git_oid &oid ) const
+   {
+      return memcmp( this->id, oid.id, GIT_OID_RAWSZ );
+   }
+
+   int cmp( const Raw_oid &oid ) const
+   {
+      return memcmp( this->id, oid.id, GIT_OID_RAWSZ );
+   }
+
 private:
    union
    {
@@ -532,6 +576,61 @@ static_assert( sizeof( Raw_oid ) == 32 );
 
 
 
+/**
+ * omp 文件中的一个映射项
+ */
+struct omp_item
+{
+   Raw_oid  k;
+   Raw_oid  v;
+};
+
+static_assert( sizeof( omp_item ) == 64 );
+
+
+
+/**
+ * 内存中的一个映射, 明文 oid 与密文 oid 互相映射, 每个映射只保存一份
+ *
+ * 旧版本保存的映射不区分方向, 所以 plain 与 cipher 只表示插入时的方向, 查找时两边都会查
+ */
+struct Omp_pair
+{
+   enum : uint8_t
+   {
+      VISITED       = 1,      // 本次运行中已经处理过
+      PLAIN_EXISTS  = 2,      // 本次运行中已确认 plain 对象存在
+      CIPHER_EXISTS = 4,      // 本次运行中已确认 cipher 对象存在
+   };
+
+   git_oid                    plain;
+   git_oid                    cipher;
+   std::atomic< uint8_t >     flags;
+
+
+   const git_oid & other( const git_oid &oid ) const
+   {
+      return ( oid == plain ) ? cipher : plain;
+   }
+
+
+   /**
+    * 标记为已处理, 返回是否是第一次标记
+    */
+   bool visit( )
+   {
+      return ( flags.fetch_or( VISITED ) & VISITED ) == 0;
+   }
+
+
+   bool visited( ) const
+   {
+      return ( flags.load( ) & VISITED ) != 0;
+   }
+};
+
+
+
 class GitStrArray
 {
 public:
@@ -566,23 +665,144 @@ private:
 
 
 
+/**
+ * 一组引用修改, 由 commit 以一个 git_transaction 一起写入, 修改的引用很多时, 之后再打包成 packed-refs
+ */
+class Ref_batch
+{
+public:
+   Ref_batch( git_repository *r )
+      : _repo( r )
+   { }
+
+   ~Ref_batch( );
+
+   void set( const std::string &, const git_oid & );
+   void remove( const std::string & );
+   void commit( );
+
+private:
+   void lock( const std::string & );
+
+private:
+   git_repository                     *_repo;
+   git_transaction                    *_tx{ };
+   std::unordered_set< std::string >   _locked;
+};
+
+
+
 using  Oid_set = std::unordered_set< git_oid >;
 using  Oid_vec = std::vector< git_oid >;
 
 
 
+/**
+ * 所有加密提交使用的固定作者信息
+ */
+inline constexpr char xcrypt_author[] =
+   "author git-remote-xcrypt <xxw_pc@163.com> 1713075873 +0800\n"
+   "committer git-remote-xcrypt <xxw_pc@163.com> 1713075873 +0800\n\n";
+
+
+
 void init_crypt( );
-void encrypt( git_revwalk * );
+void get_commit_refs( Oid_vec &, git_odb_object * );
+void encrypt( git_revwalk *, const std::function< void( const git_oid & ) > & = { } );
 void encrypt( git_oid & );
 void decrypt( git_revwalk * );
 void decrypt( git_oid & );
+void decrypt( const Oid_vec &, Oid_set & );
+void decrypt_commits( const Oid_vec & );
+int64_t decrypt_commit_time( const git_oid & );
+bool decrypt_stream( const uint8_t *, size_t, git_otype );
+
+void fetch_pack_begin( );
+void fetch_stream_begin( );
+size_t fetch_stream_end( );
+bool fetch_pack_objects( Oid_vec & );
+
+
+extern int        shallow_depth;
+extern int64_t    shallow_since;
+
+bool shallow_requested( );
+bool shallow_parse_depth( std::string_view );
+bool shallow_parse_since( std::string_view );
+void shallow_read( git_repository *, Oid_vec & );
+void shallow_write( git_repository *, Oid_vec );
+void shallow_decrypt( const Oid_vec & );
+
+
+/**
+ * pack 模式下远程仓库的清单
+ *
+ * 远程仓库中只有两类引用:
+ *   refs/xcrypt/manifest   清单提交, 其树中只有一个加密的 manifest 文件
+ *   refs/xcrypt/packs/<id> 每次推送生成的一个 pack 提交, 其树由加密的 pack 分块组成
+ */
+struct Manifest
+{
+   bool                                has_commit{ };
+   git_oid                             commit{ };
+   std::string                         head;
+   std::vector< std::string >          packs;
+   std::map< std::string, git_oid >    refs;
+};
+
+using Tree_entries = std::vector< std::pair< std::string, git_oid > >;
+
+git_oid write_sealed( const void *, size_t );
+size_t read_sealed( Memory<> &, git_odb_object * );
+git_oid write_tree( const Tree_entries & );
+void read_tree( Tree_entries &, const git_oid & );
+git_oid get_commit_tree( const git_oid & );
+git_oid write_commit( const git_oid &, const git_oid *, const char * );
+
+void manifest_load( Manifest &, const git_oid & );
+void manifest_store( Manifest & );
+bool pack_encrypt( git_oid &, git_revwalk * );
+void pack_decrypt( const git_oid & );
+
+void pack_writer_begin( bool );
+void pack_writer_end( );
+size_t pack_writer_size( );
+void odb_write( git_oid &, const void *, size_t, git_otype, bool );
 
 
 std::filesystem::path omp_path( );
 void omp_load( );
-std::pair< const git_oid, const git_oid > * omp_find( const git_oid & );
-void omp_insert( const git_oid &, const git_oid & );
+void omp_sync( );
+void omp_reserve( size_t );
+void omp_bulk_begin( );
+Omp_pair * omp_find( const git_oid & );
+Omp_pair * omp_insert( const git_oid &, const git_oid & );
+Omp_pair * omp_import( const git_oid &, const git_oid & );
+void omp_verify( Oid_vec & );
+void omp_refresh( );
+size_t omp_rebuild( );
+bool parse_edge( git_oid &, size_t &, const uint8_t *, size_t );
+bool omp_cipher_origin( git_oid &, size_t &, git_otype &, const git_oid & );
+bool omp_retain( const Oid_set &, std::vector< omp_item > & );
+size_t omp_gc( bool );
+size_t omp_prune( );
+std::filesystem::path prune_lock_path( );
+bool omp_pruned( const git_oid & );
+void omp_tombstone( const Oid_vec & );
+void omp_visited( std::vector< omp_item > & );
+bool omp_snapshot_build( git_oid &, const git_oid * );
+void omp_snapshot_import( const git_oid &, const git_oid * );
+void omp_flush( );
 void omp_store( );
+void omp_clear( bool );
+
+bool omp_index_open( const std::filesystem::path & );
+void omp_index_close( );
+size_t omp_index_size( );
+bool omp_index_find( const git_oid &, git_oid & );
+void omp_index_items( std::vector< omp_item > & );
+bool omp_index_merge( const std::filesystem::path &, std::vector< omp_item > & );
+bool omp_index_rewrite( const std::filesystem::path &, std::vector< omp_item > & );
 
 
 
@@ -596,6 +816,7 @@ enum
    PROG_RECEIVE,
    PROG_UNPACK,
    PROG_WRITE,
+   PROG_SCAN,
    PROG_EXIT,
 };
 
@@ -608,12 +829,18 @@ void progress_init( );
 int  progress( unsigned, uintmax_t, uintmax_t );
 void progress_end_line( );
 void progress_exit( );
+void progress_quiet( );
 
 
 
 void repo_close( );
+void xrepo_open( );
+git_repository * xrepo_reopen( );
 std::string get_secret_key_config_name( const char * );
+std::string get_mode_config_name( const char * );
+std::string get_snapshot_config_name( const char * );
 void check_secret_key_format( const char * );
+bool get_remote_password( Password &, git_config *, const char * );
 void load_remote( const char * );
 
 
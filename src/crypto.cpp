@@ -18,6 +18,7 @@
 
 #include <condition_variable>
 #include <mutex>
+#include <unordered_map>
 
 #include <boost/endian/arithmetic.hpp>
 #include <boost/utility.hpp>
@@ -26,13 +27,6 @@
 
 
 
-/**
- * 已经处理过的 oid
- */
-static Oid_set  crypto_set;
-
-
-
 /**
  * 对象加密分两步
  * 1. 使用 bzip3 压缩数据
@@ -133,9 +127,9 @@ static git_otype get_otype( const git_oid &oid )
 
 
 
-static void encrypt_have( git_otype otype, std::pair< const git_oid, const git_oid > *pair )
+static void encrypt_have( git_otype otype, const git_oid &plain, const git_oid &cipher )
 {
-   trace( "encrypt ", otype, ' ', pair->first, "\n               ", pair->second );
+   trace( "encrypt ", otype, ' ', plain, "\n               ", cipher );
    prog_num_2 = prog_num_2 + 1;
 }
 
@@ -145,6 +139,16 @@ void encrypt( encrypt_element & );
 
 
 
+/**
+ * 密文已被 prune 删除, 推送时 packbuilder 可能需要读取, 由调用者重新加密生成 (结果与原密文相同)
+ */
+static bool cipher_pruned( const git_oid &cipher )
+{
+   return omp_pruned( cipher ) && !git_odb_exists( odb, &cipher );
+}
+
+
+
 void get_commit_refs( Oid_vec &refs, git_odb_object *obj )
 {
    auto  sv = to_sv( obj );
@@ -285,16 +289,12 @@ static size_t encrypt_buff( const git_oid &oid, const uint8_t *data, size_t size
 
 static void encrypt_commit( encrypt_element &top )
 {
-   static constexpr char author[] =
-      "author git-remote-xcrypt <xxw_pc@163.com> 1713075873 +0800\n"
-      "committer git-remote-xcrypt <xxw_pc@163.com> 1713075873 +0800\n\n";
-
    // 加密后的原提交
    auto    text_size = encrypt_buff( top.oid, top.obj_data, top.obj_size );
 
    // 新 commit 的大小
    size_t  need_size = top.refs.size( ) * ( 6 + 1 + 40 + 1 ) - 2;
-   need_size += sizeof( author ) - 1;
+   need_size += sizeof( xcrypt_author ) - 1;
    need_size += boost::beast::detail::base64::encoded_size( text_size );
    need_size += ( text_size - 1 ) / 48;
 
@@ -314,7 +314,7 @@ static void encrypt_commit( encrypt_element &top )
    for ( size_t i = 1; i < top.refs.size( ); ++i )
       out << "parent " << top.refs[i] << '\n';
 
-   out << author;
+   out << xcrypt_author;
 
    // 将 cipher_buff 中密文, 编码为 base64 追加到 text 后面, 每 64 base64 字节一行
    auto  ptr = text_buff;
@@ -336,8 +336,7 @@ static void encrypt_commit( encrypt_element &top )
    out += sz;
 
    //
-   auto  ret = git_odb_write( &top.oid, odb, out.data( ), out.size( ), GIT_OBJ_COMMIT );
-   git_ensure( ret );
+   odb_write( top.oid, out.data( ), out.size( ), GIT_OBJ_COMMIT, true );
 }
 
 
@@ -425,8 +424,7 @@ static void encrypt_tree( encrypt_element &top )
 
    out.append( top.oid.id, GIT_OID_RAWSZ );
 
-   auto  ret = git_odb_write( &top.oid, odb, out.data( ), out.size( ), GIT_OBJ_TREE );
-   git_ensure( ret );
+   odb_write( top.oid, out.data( ), out.size( ), GIT_OBJ_TREE, true );
 }
 
 
@@ -435,8 +433,7 @@ static void encrypt_blob( encrypt_element &top )
 {
    auto  text_size = encrypt_buff( top.oid, top.obj_data, top.obj_size );
 
-   auto  ret = git_odb_write( &top.oid, odb, text_buff, text_size, GIT_OBJ_BLOB );
-   git_ensure( ret );
+   odb_write( top.oid, text_buff, text_size, GIT_OBJ_BLOB, true );
 }
 
 
@@ -444,13 +441,15 @@ static void encrypt_blob( encrypt_element &top )
 void encrypt_object( encrypt_element &top )
 {
    auto  pair = omp_find( top.oid );
-   if ( pair != nullptr )
+   if ( ( pair != nullptr ) && !cipher_pruned( pair->other( top.oid ) ) )
    {
-      top.oid = pair->second;
+      auto  &plain = top.oid;
+      auto  &cipher = pair->other( plain );
 
-      if ( crypto_set.emplace( pair->first ).second )
-         encrypt_have( get_otype( pair->first ), pair );
+      if ( pair->visit( ) )
+         encrypt_have( get_otype( plain ), plain, cipher );
 
+      top.oid = cipher;
       return;
    }
 
@@ -467,21 +466,17 @@ void encrypt_object( encrypt_element &top )
    trace( "encrypt ", git_odb_object_type( top.obj ), ' ', old_oid, "\n             . ", top.oid );
 
    prog_num_1 = prog_num_1 + 1;
-   omp_insert( old_oid, top.oid );
-   crypto_set.emplace( old_oid );
+   omp_insert( old_oid, top.oid )->visit( );
 }
 
 
 
 static bool encrypt_push( git_oid &oid, git_otype otype )
 {
-   if ( crypto_set.contains( oid ) )
+   auto  pair = omp_find( oid );
+   if ( ( pair != nullptr ) && pair->visited( ) )
    {
-      auto  pair = omp_find( oid );
-      ensure( pair != nullptr );
-
-      oid = pair->second;
-
+      oid = pair->other( oid );
       return false;
    }
 
@@ -503,8 +498,8 @@ static bool encrypt_push_ref( encrypt_element &top )
       for ( auto &ref_oid : std::views::drop( top.refs, 1 ) )
       {
          auto  map = omp_find( ref_oid );
-         if ( map != nullptr )
-            ref_oid = map->second;
+         if ( ( map != nullptr ) && !cipher_pruned( map->other( ref_oid ) ) )
+            ref_oid = map->other( ref_oid );
 
          else
          {
@@ -585,29 +580,61 @@ static void encrypt_loop( )
 
 
 
-void encrypt( git_revwalk *walk )
+/**
+ * 每写出这么多密文, 结束当前 pack 并调用 staged, 使上传与之后的加密同时进行
+ */
+static constexpr size_t  STAGE_SIZE = 256 * 1024 * 1024;
+
+
+
+/**
+ * 加密 walk 中的提交
+ *
+ * staged 不为空时, 每写出 STAGE_SIZE 的密文, 结束当前 pack 并以刚加密的提交的密文调用 staged,
+ * 此时该提交及其引用的所有密文对象都已在对象库中
+ */
+void encrypt( git_revwalk *walk, const std::function< void( const git_oid & ) > &staged )
 {
    ensure( encrypt_stack.empty( ) );
    encrypt_stack.clear( );
 
-   // 由于 encrypt_stack 里保存的都是 oid 引用, 需要 vec 保存所有原始 oid
+   // 由于 encrypt_stack 里保存的都是 oid 引用, 需要 vec 保存所有原始 oid, 加密后为密文的 oid
    Oid_vec  vec;
    git_oid  oid;
 
    while ( git_revwalk_next( &oid, walk ) == 0 )
       vec.emplace_back( oid );
 
-   // 将所有需要加密的 oid 无条件入栈
-   for ( auto &oid : vec )
-      encrypt_stack.emplace_back( oid );
-
    // 启动计数显示线程
    progress( PROG_ENCRYPT, 0, 0 );
 
-   // 正式开始加密
-   encrypt_loop( );
+   // 正式开始加密, 密文写入同一个 pack, 结束后才能从对象库中读到
+   pack_writer_begin( true );
+
+   // 所有需要加密的 oid 无条件入栈, 从 vec 的末尾 (最旧的提交) 开始, 逐个入栈与全部入栈后再加密的顺序相同
+   for ( auto itr = vec.rbegin( ); itr != vec.rend( ); ++itr )
+   {
+      encrypt_stack.emplace_back( *itr );
+      encrypt_loop( );
+
+      if ( staged && ( pack_writer_size( ) >= STAGE_SIZE ) && ( ( itr + 1 ) != vec.rend( ) ) )
+      {
+         uintmax_t  num_1 = prog_num_1;
+         uintmax_t  num_2 = prog_num_2;
+
+         pack_writer_end( );
+
+         staged( *itr );
+
+         progress( PROG_ENCRYPT, num_1, num_2 );
+
+         pack_writer_begin( true );
+      }
+   }
 
    progress_end_line( );
+
+   pack_writer_end( );
 }
 
 
@@ -620,10 +647,14 @@ void encrypt( git_oid &oid )
 
 
 
-static void decrypt( git_oid &oid, const uint8_t *data, size_t size, git_otype o_type )
+/**
+ * 解密并解压, 原对象在 text_buff 中, 返回原对象的长度
+ * 压缩层保存在 bzip_buff 中, 长度为 bzip_size, 其首尾记录了原对象的 oid
+ */
+static size_t decrypt_text( size_t &bzip_size, const uint8_t *data, size_t size )
 {
    // 解密得到压缩层数据
-   auto  bzip_size = aes_decrypt( bzip_buff, data, size );
+   bzip_size = aes_decrypt( bzip_buff, data, size );
 
    ensure( bzip_size >= ( 16 + 2 + 8 + 16 ) );
 
@@ -665,17 +696,43 @@ static void decrypt( git_oid &oid, const uint8_t *data, size_t size, git_otype o
    if ( bz3 != ::bz3 )
       bz3_free( bz3 );
 
-   ret = git_odb_write( &oid, odb, text_buff, file_size, o_type );
-   git_ensure( ret );
+   return file_size;
+}
+
 
-   // 比较 hash
-   ensure( memcmp( bzip_buff, oid.id, 16 ) == 0 );
 
-   ptr = bzip_buff + bzip_size - 16;
-   ensure( memcmp( ptr, oid.id + 16, 4 ) == 0 );
+/**
+ * 原对象的 oid 是否与压缩层中记录的一致
+ */
+static bool decrypt_match( const git_oid &oid, size_t bzip_size )
+{
+   if ( memcmp( bzip_buff, oid.id, 16 ) != 0 )
+      return false;
+
+   auto  ptr = bzip_buff + bzip_size - 16;
+   if ( memcmp( ptr, oid.id + 16, 4 ) != 0 )
+      return false;
 
    for ( size_t i = 4; i < 16; ++i )
-      ensure( ptr[i] == 0 );
+   {
+      if ( ptr[i] != 0 )
+         return false;
+   }
+
+   return true;
+}
+
+
+
+static void decrypt( git_oid &oid, const uint8_t *data, size_t size, git_otype o_type )
+{
+   size_t  bzip_size;
+   auto    file_size = decrypt_text( bzip_size, data, size );
+
+   odb_write( oid, text_buff, file_size, o_type, false );
+
+   // 比较 hash
+   ensure( decrypt_match( oid, bzip_size ) );
 }
 
 
@@ -687,7 +744,10 @@ static void decrypt( git_oid &oid, const void *data, size_t size, git_otype o_ty
 
 
 
-static void decrypt_commit( git_oid &oid, git_odb_object *obj )
+/**
+ * 将加密提交中分行的 base64 解码到 text_buff, 返回密文的长度
+ */
+static size_t decode_commit( git_odb_object *obj )
 {
    auto  sv = to_sv( obj );
 
@@ -716,11 +776,76 @@ static void decrypt_commit( git_oid &oid, git_odb_object *obj )
    auto  ret = boost::beast::detail::base64::decode( ptr, sv.data( ), sv.size( ) );
    ptr += ret.first;
 
-   decrypt( oid, text_buff, ptr - text_buff, GIT_OBJ_COMMIT );
+   return ptr - text_buff;
+}
+
+
+
+static void decrypt_commit( git_oid &oid, git_odb_object *obj )
+{
+   decrypt( oid, text_buff, decode_commit( obj ), GIT_OBJ_COMMIT );
+}
+
+
+
+/**
+ * 密文提交 cipher 对应的明文提交的提交时间
+ * 尚未解密过时, 只在内存中解密提交本身, 不写入明文仓库, 也不记录映射
+ */
+int64_t decrypt_commit_time( const git_oid &cipher )
+{
+   git_odb_object     *obj;
+   std::string_view    text;
+
+   auto  map = omp_find( cipher );
+
+   if ( ( map != nullptr ) && ( git_odb_read( &obj, plain_odb, &map->other( cipher ) ) == 0 ) )
+      text = to_sv( obj );
+
+   else
+   {
+      auto  ret = git_odb_read( &obj, odb, &cipher );
+      git_ensure( ret );
+
+      ensure( git_odb_object_type( obj ) == GIT_OBJ_COMMIT );
+
+      size_t  bzip_size;
+      auto    size = decrypt_text( bzip_size, text_buff, decode_commit( obj ) );
+
+      git_oid  plain;
+      ret = git_odb_hash( &plain, text_buff, size, GIT_OBJ_COMMIT );
+      git_ensure( ret );
+
+      ensure( decrypt_match( plain, bzip_size ) );
+
+      text = std::string_view( reinterpret_cast< const char * >( text_buff ), size );
+   }
+
+   // committer <name> <email> <time> <tz>
+   auto  pos = text.find( "\ncommitter " );
+   ensure( pos != text.npos );
+
+   auto  line = text.substr( pos + 1, text.find( '\n', pos + 1 ) - pos - 1 );
+   auto  gt   = line.rfind( '>' );
+   ensure( gt != line.npos );
+
+   auto  time = strtoll( line.data( ) + gt + 1, nullptr, 10 );
+
+   git_odb_object_free( obj );
+
+   return time;
 }
 
 
 
+/**
+ * 拉取的数据流中, 按 blob 解密后发现是树密文的 blob -> 明文树, 明文树已经写入, 解密对应的加密树时直接使用
+ * 只在数据流的后台线程中写入, 数据流结束后才读取
+ */
+static std::unordered_map< git_oid, git_oid >   tree_blobs;
+
+
+
 static void decrypt_tree( git_oid &oid, git_odb_object *obj )
 {
    auto  sv = to_sv( obj );
@@ -729,6 +854,12 @@ static void decrypt_tree( git_oid &oid, git_odb_object *obj )
 
    git_oid_fromraw( &oid, reinterpret_cast< const uint8_t * >( sv.data( ) ) + sv.size( ) - GIT_OID_RAWSZ );
 
+   if ( auto itr = tree_blobs.find( oid ); itr != tree_blobs.end( ) )
+   {
+      oid = itr->second;
+      return;
+   }
+
    auto  ret = git_odb_read( &obj, odb, &oid );
    git_ensure( ret );
 
@@ -750,8 +881,10 @@ void decrypt( git_oid &oid, git_odb_object *obj )
    auto  map = omp_find( oid );
    if ( map != nullptr )
    {
-      trace( "decrypt ", git_odb_object_type( obj ), ' ', oid, "\n               ", map->second );
-      oid = map->second;
+      auto  &plain = map->other( oid );
+
+      trace( "decrypt ", git_odb_object_type( obj ), ' ', oid, "\n               ", plain );
+      oid = plain;
 
       prog_num_2 = prog_num_2 + 1;
       return;
@@ -772,38 +905,314 @@ void decrypt( git_oid &oid, git_odb_object *obj )
 
    prog_num_1 = prog_num_1 + 1;
 
-   omp_insert( old_oid, oid );
+   omp_insert( oid, old_oid );
 }
 
 
 
-void decrypt( git_revwalk *walk )
+/**
+ * 解密密文对象 cipher, 不是密文 (格式不符, 或者首尾解密后不符) 时返回 false, 不中止
+ * 首尾相符, 但完整解密后长度或 oid 不符时, 与 decrypt 相同, 中止
+ * 首尾解密要求尾块的 12 个字节为 0, 不是密文的对象 (例如 omp 快照) 或其他密钥的密文通过的概率可以忽略, 不会因此中止
+ *
+ * otype 为 GIT_OBJ_TREE 时, data 为保存树密文的 blob 的内容
+ */
+static bool decrypt_checked( const git_oid &cipher, const uint8_t *data, size_t size, git_otype otype )
 {
-   git_odb_object         *obj;
-   std::vector< git_oid >  refs;
-   std::list< git_oid >    list;
-   Oid_set                 set;
+   if ( otype == GIT_OBJ_COMMIT )
+   {
+      // 与 decrypt_commit 相同, 但格式不符时不中止
+      std::string_view  sv( reinterpret_cast< const char * >( data ), size );
 
-   //
-   git_oid                 oid;
+      auto  pos = sv.find( xcrypt_author );
+      if ( pos == sv.npos )
+         return false;
 
-   while ( git_revwalk_next( &oid, walk ) == 0 )
+      sv.remove_prefix( pos + sizeof( xcrypt_author ) - 1 );
+
+      if ( boost::beast::detail::base64::decoded_size( sv.size( ) ) > sizeof( text_buff ) )
+         return false;
+
+      auto  ptr = text_buff;
+
+      while ( sv.size( ) > 64 )
+      {
+         if ( sv[64] != '\n' )
+            return false;
+
+         auto  ret = boost::beast::detail::base64::decode( ptr, sv.data( ), 64 );
+         if ( ret.first != 48 )
+            return false;
+
+         ptr += 48;
+         sv.remove_prefix( 65 );
+      }
+
+      auto  ret = boost::beast::detail::base64::decode( ptr, sv.data( ), sv.size( ) );
+      ptr += ret.first;
+
+      data = text_buff;
+      size = ptr - text_buff;
+   }
+
+   if ( ( size < 48 ) || ( ( size % 16 ) != 0 ) )
+      return false;
+
+   git_oid  plain;
+   size_t   plain_size;
+
+   if ( !parse_edge( plain, plain_size, data, size ) || ( plain_size > MAX_FILE ) )
+      return false;
+
+   size_t  bzip_size;
+   auto    file_size = decrypt_text( bzip_size, data, size );
+
+   ensure( file_size == plain_size );
+
+   git_oid  oid;
+   auto  ret = git_odb_hash( &oid, text_buff, file_size, otype );
+   git_ensure( ret );
+
+   // 保存树密文的 blob 与普通文件的 blob 无法事先区分, oid 不符时按树再比较一次, 明文树留给对应的加密树使用
+   if ( !decrypt_match( oid, bzip_size ) && ( otype == GIT_OBJ_BLOB ) )
+   {
+      ret = git_odb_hash( &oid, text_buff, file_size, GIT_OBJ_TREE );
+      git_ensure( ret );
+
+      if ( decrypt_match( oid, bzip_size ) )
+      {
+         odb_write( oid, text_buff, file_size, GIT_OBJ_TREE, false );
+
+         trace( "decrypt ", GIT_OBJ_TREE, ' ', cipher, "\n             ~ ", oid );
+
+         tree_blobs.emplace( cipher, oid );
+         return true;
+      }
+   }
+
+   ensure( decrypt_match( oid, bzip_size ) );
+
+   odb_write( oid, text_buff, file_size, otype, false );
+
+   trace( "decrypt ", otype, ' ', cipher, "\n             ~ ", oid );
+
+   omp_insert( oid, cipher );
+
+   return true;
+}
+
+
+
+/**
+ * 解密拉取时从 pack 数据流中直接得到的密文对象, 此时对象还不在对象库中, 成功时返回 true
+ *
+ * 只处理 commit 与 blob: 加密树的密文在另一个 blob 中, 保存树密文的 blob 由 decrypt_checked 按树解密,
+ * 之后解密加密树时直接使用, 每个树只解密一次; 不是密文的对象 (例如 omp 快照) 跳过
+ */
+bool decrypt_stream( const uint8_t *data, size_t size, git_otype otype )
+{
+   git_oid  cipher;
+   auto  ret = git_odb_hash( &cipher, data, size, otype );
+   git_ensure( ret );
+
+   if ( omp_find( cipher ) != nullptr )
+      return true;
+
+   if ( ( otype != GIT_OBJ_COMMIT ) && ( otype != GIT_OBJ_BLOB ) )
+      return false;
+
+   return decrypt_checked( cipher, data, size, otype );
+}
+
+
+
+/**
+ * 加密树的最后一项为 "100664 <序号>", 指向保存树密文的 blob, 格式不符时返回 false
+ */
+static bool get_cipher_blob( git_oid &blob, git_odb_object *obj )
+{
+   auto  sv = to_sv( obj );
+
+   std::string_view  mode;
+   std::string_view  name;
+
+   while ( !sv.empty( ) )
    {
-      list.emplace_back( oid );
-      set.emplace( oid );
+      auto  sp = sv.find( ' ' );
+      if ( sp == sv.npos )
+         return false;
+
+      auto  nul = sv.find( '\0', sp + 1 );
+      if ( ( nul == sv.npos ) || ( sv.size( ) < ( nul + 1 + GIT_OID_RAWSZ ) ) )
+         return false;
+
+      mode = sv.substr( 0, sp );
+      name = sv.substr( sp + 1, nul - sp - 1 );
+
+      git_oid_fromraw( &blob, reinterpret_cast< const uint8_t * >( sv.data( ) ) + nul + 1 );
+
+      sv.remove_prefix( nul + 1 + GIT_OID_RAWSZ );
    }
 
+   return ( mode == "100664" ) && !name.empty( ) && std::all_of( name.begin( ), name.end( ), isdigit );
+}
+
+
+
+/**
+ * 按 oids 的顺序 (新下载的 pack 中的偏移顺序) 解密, 读取 pack 是顺序的, 也不需要递归树
+ *
+ * 先解密 commit 与树, 再解密 blob, 保存树密文的 blob 在解密树时已经用过, 不再按 blob 解密
+ * 不是密文的对象 (例如 omp 快照) 跳过, 记录到 skipped, 由调用者确认它们不属于要解密的分支
+ */
+void decrypt( const Oid_vec &oids, Oid_set &skipped )
+{
+   if ( oids.empty( ) )
+      return;
+
+   progress( PROG_DECRYPT, 0, 0 );
+
+   pack_writer_begin( false );
+
+   Oid_vec  blobs;
+   Oid_set  cipher_blobs;
+
+   auto  decrypt_one = [&]( const git_oid &oid, const git_oid &data_oid, git_otype otype )
+   {
+      git_odb_object  *obj;
+
+      auto  ret = git_odb_read( &obj, odb, &data_oid );
+      git_ensure( ret );
+
+      auto  data = static_cast< const uint8_t * >( git_odb_object_data( obj ) );
+
+      if ( decrypt_checked( oid, data, git_odb_object_size( obj ), otype ) )
+         prog_num_1 = prog_num_1 + 1;
+      else
+         skipped.emplace( oid );
+
+      git_odb_object_free( obj );
+   };
+
+   for ( auto &oid : oids )
+   {
+      if ( omp_find( oid ) != nullptr )
+      {
+         prog_num_2 = prog_num_2 + 1;
+         continue;
+      }
+
+      size_t     len;
+      git_otype  otype;
+
+      auto  ret = git_odb_read_header( &len, &otype, odb, &oid );
+      git_ensure( ret );
+
+      switch ( otype )
+      {
+      case GIT_OBJ_COMMIT:
+         decrypt_one( oid, oid, otype );
+         break;
+
+      case GIT_OBJ_TREE:
+      {
+         git_odb_object  *obj;
+
+         ret = git_odb_read( &obj, odb, &oid );
+         git_ensure( ret );
+
+         git_oid  blob;
+         bool     succ = get_cipher_blob( blob, obj );
+
+         git_odb_object_free( obj );
+
+         if ( succ )
+         {
+            cipher_blobs.emplace( blob );
+
+            // 数据流中已经按树解密过
+            if ( auto itr = tree_blobs.find( blob ); itr != tree_blobs.end( ) )
+            {
+               omp_insert( itr->second, oid );
+               prog_num_2 = prog_num_2 + 1;
+            }
+            else
+               decrypt_one( oid, blob, otype );
+         }
+         else
+            skipped.emplace( oid );
+
+         break;
+      }
+
+      case GIT_OBJ_BLOB:
+         blobs.emplace_back( oid );
+         break;
+
+      default:
+         break;
+      }
+   }
+
+   for ( auto &oid : blobs )
+   {
+      if ( !cipher_blobs.contains( oid ) && !tree_blobs.contains( oid ) )
+         decrypt_one( oid, oid, GIT_OBJ_BLOB );
+   }
+
+   progress_end_line( );
+
+   pack_writer_end( );
+}
+
+
+
+void decrypt( git_revwalk *walk )
+{
+   Oid_vec  commits;
+   git_oid  oid;
+
+   while ( git_revwalk_next( &oid, walk ) == 0 )
+      commits.emplace_back( oid );
+
+   decrypt_commits( commits );
+}
+
+
+
+/**
+ * 解密 commits 中的提交及其树
+ */
+void decrypt_commits( const Oid_vec &commits )
+{
+   git_odb_object         *obj;
+   std::vector< git_oid >  refs;
+   std::list< git_oid >    list( commits.begin( ), commits.end( ) );
+   Oid_set                 set( commits.begin( ), commits.end( ) );
+
    if ( list.empty( ) )
       return;
 
    // 启动计数显示线程
    progress( PROG_DECRYPT, 0, 0 );
 
+   // 明文写入同一个 pack, 避免克隆后留下大量松散对象
+   pack_writer_begin( false );
+
    //
    while ( !list.empty( ) )
    {
       auto 	itr = list.begin( );
 
+      // 密文已被 prune 删除, 映射仍然可信, 明文及其子对象都已存在, 远程也不会重发
+      if ( cipher_pruned( *itr ) && ( omp_find( *itr ) != nullptr ) )
+      {
+         prog_num_2 = prog_num_2 + 1;
+
+         list.erase( itr );
+         continue;
+      }
+
       auto  ret = git_odb_read( &obj, odb, &*itr );
       git_ensure( ret );
 
@@ -845,6 +1254,8 @@ void decrypt( git_revwalk *walk )
    }
 
    progress_end_line( );
+
+   pack_writer_end( );
 }
 
 
@@ -0,0 +1,711 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+
+#include <boost/endian/arithmetic.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <git2/sys/odb_backend.h>
+
+#include <zlib.h>
+
+#include "common.h"
+
+
+
+/**
+ * 克隆时边下载边解密
+ *
+ * 只用于克隆: 普通的 fetch 可能只请求部分分支, 而下载时还不知道请求哪些, 未请求分支的对象不应解密
+ *
+ * libgit2 下载 pack 时, 通过对象库的 writepack 写入, 在密文仓库的对象库中加入一个优先级最高的 backend,
+ * 它的 writepack 将数据交给真正的 pack backend, 同时复制一份给后台线程
+ * 后台线程解析 pack 数据流, 每得到一个完整的非 delta 的 commit 或 blob, 就直接解密 (见 decrypt_stream),
+ * 解密与下载同时进行, 而不是等整个 pack 下载并建立索引之后才开始
+ *
+ * 树的密文在一个 blob 中, 这样的 blob 在数据流中直接按树解密, 之后解密加密树时不再重复解密
+ *
+ * 只是尽力而为: delta 对象, 以及来不及处理的对象, 仍由之后的 decrypt_fetch 解密, 已解密的对象在那时直接跳过
+ * 积压的数据超过 STREAM_LIMIT 时, 放弃本次的边下载边解密, 不让解密拖慢下载
+ *
+ * 下载前后比较密文仓库中的 pack 索引, 得到新下载的 pack, decrypt_fetch 按其中的偏移顺序解密剩余的对象
+ */
+
+
+
+/**
+ * 积压的未解析数据上限
+ */
+static constexpr size_t  STREAM_LIMIT = 256 * 1024 * 1024;
+
+/**
+ * 超过此长度的对象不在数据流中解密
+ */
+static constexpr size_t  STREAM_OBJECT_MAX = 64 * 1024 * 1024;
+
+
+
+namespace
+{
+   /**
+    * pack 数据流的增量解析
+    */
+   class Pack_parser
+   {
+      enum State
+      {
+         HEAD,          // 文件头
+         OBJ_HEAD,      // 对象头: 类型与长度
+         OFS_BASE,      // OFS_DELTA 的基对象偏移
+         REF_BASE,      // REF_DELTA 的基对象 oid
+         DATA,          // zlib 数据
+         TRAILER,       // 校验和, 忽略
+      };
+
+   public:
+      Pack_parser( )
+      {
+         ensure( inflateInit( &_zs ) == Z_OK );
+      }
+
+
+      ~Pack_parser( )
+      {
+         inflateEnd( &_zs );
+      }
+
+
+      /**
+       * 已处理的对象数
+       */
+      size_t decrypted( ) const
+      {
+         return _decrypted;
+      }
+
+
+      /**
+       * 返回 false 表示数据格式错误, 之后不再解析
+       */
+      bool feed( const uint8_t *data, size_t size )
+      {
+         while ( size > 0 )
+         {
+            switch ( _state )
+            {
+            case HEAD:
+               {
+                  auto  n = std::min( size, 12 - _used );
+                  memcpy( _head + _used, data, n );
+                  _used += n;
+                  data  += n;
+                  size  -= n;
+
+                  if ( _used < 12 )
+                     break;
+
+                  if ( memcmp( _head, "PACK", 4 ) != 0 )
+                     return false;
+
+                  _count = ( size_t( _head[8] ) << 24 ) | ( size_t( _head[9] ) << 16 ) | ( size_t( _head[10] ) << 8 ) | _head[11];
+                  _state = ( _count > 0 ) ? OBJ_HEAD : TRAILER;
+                  _used  = 0;
+
+                  // 在插入第一个映射之前, 按文件头中的对象数一次预留映射表
+                  omp_reserve( _count );
+               }
+               break;
+
+            case OBJ_HEAD:
+               {
+                  auto  c = *data++;
+                  --size;
+
+                  if ( _used == 0 )
+                  {
+                     _type  = ( c >> 4 ) & 7;
+                     _size  = c & 15;
+                     _shift = 4;
+                  }
+                  else
+                  {
+                     if ( _shift > 56 )
+                        return false;
+
+                     _size  |= size_t( c & 0x7F ) << _shift;
+                     _shift += 7;
+                  }
+
+                  ++_used;
+
+                  if ( ( c & 0x80 ) != 0 )
+                     break;
+
+                  _used = 0;
+
+                  if ( _type == 6 )
+                     _state = OFS_BASE;
+
+                  else if ( _type == 7 )
+                     _state = REF_BASE;
+
+                  else
+                     begin_data( );
+               }
+               break;
+
+            case OFS_BASE:
+               {
+                  auto  c = *data++;
+                  --size;
+
+                  if ( ( c & 0x80 ) == 0 )
+                     begin_data( );
+               }
+               break;
+
+            case REF_BASE:
+               {
+                  auto  n = std::min( size, GIT_OID_RAWSZ - _used );
+                  _used += n;
+                  data  += n;
+                  size  -= n;
+
+                  if ( _used == GIT_OID_RAWSZ )
+                  {
+                     _used = 0;
+                     begin_data( );
+                  }
+               }
+               break;
+
+            case DATA:
+               {
+                  auto  n = inflate_data( data, size );
+                  if ( n == SIZE_MAX )
+                     return false;
+
+                  data += n;
+                  size -= n;
+               }
+               break;
+
+            case TRAILER:
+               return true;
+            }
+         }
+
+         return true;
+      }
+
+   private:
+      void begin_data( )
+      {
+         // 只保留可以直接解密的对象
+         _keep = ( ( _type == GIT_OBJ_COMMIT ) || ( _type == GIT_OBJ_BLOB ) ) && ( _size <= STREAM_OBJECT_MAX );
+
+         if ( _keep )
+            _data.resize( _size );
+
+         _have  = 0;
+         _state = DATA;
+      }
+
+
+      /**
+       * 返回消耗的输入字节数
+       */
+      size_t inflate_data( const uint8_t *data, size_t size )
+      {
+         uint8_t  scratch[16 * 1024];
+
+         _zs.next_in  = const_cast< uint8_t * >( data );
+         _zs.avail_in = static_cast< uInt >( std::min( size, size_t( UINT_MAX ) ) );
+
+         while ( true )
+         {
+            if ( _keep )
+            {
+               _zs.next_out  = _data.data( ) + _have;
+               _zs.avail_out = static_cast< uInt >( _size - _have );
+            }
+            else
+            {
+               _zs.next_out  = scratch;
+               _zs.avail_out = sizeof( scratch );
+            }
+
+            auto  avail = _zs.avail_out;
+            auto  ret   = inflate( &_zs, Z_NO_FLUSH );
+
+            _have += avail - _zs.avail_out;
+
+            if ( ret == Z_STREAM_END )
+               break;
+
+            if ( ( ret != Z_OK ) && ( ret != Z_BUF_ERROR ) )
+               return SIZE_MAX;
+
+            // 输入用完, 等待下一块
+            if ( _zs.avail_in == 0 )
+               return size;
+
+            // 保留的对象比声明的长度长
+            if ( _keep && ( _zs.avail_out == 0 ) )
+               return SIZE_MAX;
+         }
+
+         if ( _have != _size )
+            return SIZE_MAX;
+
+         auto  used = size - _zs.avail_in;
+
+         inflateReset( &_zs );
+
+         if ( _keep && decrypt_stream( _data.data( ), _data.size( ), static_cast< git_otype >( _type ) ) )
+            ++_decrypted;
+
+         _state = ( --_count > 0 ) ? OBJ_HEAD : TRAILER;
+
+         return used;
+      }
+
+   private:
+      State                   _state{ HEAD };
+      uint8_t                 _head[12];
+      size_t                  _used{ };
+      size_t                  _count{ };
+
+      unsigned                _type{ };
+      size_t                  _size{ };
+      unsigned                _shift{ };
+
+      z_stream                _zs{ };
+      bool                    _keep{ };
+      size_t                  _have{ };
+      std::vector< uint8_t >  _data;
+
+      size_t                  _decrypted{ };
+   };
+
+
+
+   /**
+    * 后台线程, 依次解析下载线程交来的数据块
+    */
+   class Fetch_stream
+   {
+   public:
+      Fetch_stream( )
+      {
+         _thread = std::thread( &Fetch_stream::run, this );
+      }
+
+
+      void push( const void *data, size_t size )
+      {
+         std::lock_guard  lock( _mutex );
+
+         if ( _stopped )
+            return;
+
+         // 解密跟不上下载, 放弃
+         if ( ( _queued + size ) > STREAM_LIMIT )
+         {
+            trace( "fetch stream   give up" );
+
+            _stopped = true;
+            _queue.clear( );
+            _queued = 0;
+            _cv.notify_one( );
+            return;
+         }
+
+         auto  ptr = static_cast< const uint8_t * >( data );
+         _queue.emplace_back( ptr, ptr + size );
+         _queued += size;
+
+         _cv.notify_one( );
+      }
+
+
+      /**
+       * 返回已处理的对象数
+       */
+      size_t finish( )
+      {
+         {
+            std::lock_guard  lock( _mutex );
+            _done = true;
+            _cv.notify_one( );
+         }
+
+         _thread.join( );
+
+         return _parser.decrypted( );
+      }
+
+   private:
+      void run( )
+      {
+         while ( true )
+         {
+            std::vector< uint8_t >  chunk;
+
+            {
+               std::unique_lock  lock( _mutex );
+
+               _cv.wait( lock, [this]{ return _done || _stopped || !_queue.empty( ); } );
+
+               if ( _stopped || _queue.empty( ) )
+                  return;
+
+               chunk = std::move( _queue.front( ) );
+               _queue.pop_front( );
+               _queued -= chunk.size( );
+            }
+
+            if ( !_parser.feed( chunk.data( ), chunk.size( ) ) )
+            {
+               std::lock_guard  lock( _mutex );
+
+               trace( "fetch stream   format error" );
+
+               _stopped = true;
+               _queue.clear( );
+               _queued = 0;
+               return;
+            }
+         }
+      }
+
+   private:
+      Pack_parser                            _parser;
+      std::thread                            _thread;
+      std::mutex                             _mutex;
+      std::condition_variable                _cv;
+      std::deque< std::vector< uint8_t > >   _queue;
+      size_t                                 _queued{ };
+      bool                                   _done{ };
+      bool                                   _stopped{ };
+   };
+
+
+
+   /**
+    * 包装真正的 writepack
+    */
+   struct Stream_writepack
+   {
+      git_odb_writepack     parent;
+      git_odb_writepack    *inner;
+   };
+
+
+
+   /**
+    * 只实现 writepack 的 backend, 其他操作由对象库中的其他 backend 完成
+    */
+   struct Stream_backend
+   {
+      git_odb_backend      parent;
+      git_odb_backend     *pack;
+   };
+}
+
+
+
+static std::unique_ptr< Fetch_stream >   fetch_stream;
+
+
+
+static int stream_append( git_odb_writepack *wp, const void *data, size_t size, git_transfer_progress *stats )
+{
+   auto  self = reinterpret_cast< Stream_writepack * >( wp );
+
+   auto  ret = self->inner->append( self->inner, data, size, stats );
+
+   if ( ( ret == 0 ) && ( fetch_stream != nullptr ) )
+      fetch_stream->push( data, size );
+
+   return ret;
+}
+
+
+
+static int stream_commit( git_odb_writepack *wp, git_transfer_progress *stats )
+{
+   auto  self = reinterpret_cast< Stream_writepack * >( wp );
+   return self->inner->commit( self->inner, stats );
+}
+
+
+
+static void stream_free( git_odb_writepack *wp )
+{
+   auto  self = reinterpret_cast< Stream_writepack * >( wp );
+
+   self->inner->free( self->inner );
+   delete self;
+}
+
+
+
+static int backend_writepack( git_odb_writepack **out, git_odb_backend *backend, git_odb *db, git_transfer_progress_cb cb, void *payload )
+{
+   auto  self = reinterpret_cast< Stream_backend * >( backend );
+
+   git_odb_writepack  *inner;
+
+   auto  ret = self->pack->writepack( &inner, self->pack, db, cb, payload );
+   if ( ret != 0 )
+      return ret;
+
+   auto  wp = new Stream_writepack{ };
+   wp->parent.backend = backend;
+   wp->parent.append  = &stream_append;
+   wp->parent.commit  = &stream_commit;
+   wp->parent.free    = &stream_free;
+   wp->inner          = inner;
+
+   *out = &wp->parent;
+   return 0;
+}
+
+
+
+static void backend_free( git_odb_backend *backend )
+{
+   auto  self = reinterpret_cast< Stream_backend * >( backend );
+
+   self->pack->free( self->pack );
+   delete self;
+}
+
+
+
+/**
+ * 在密文仓库的对象库中加入 Stream_backend, 只需一次
+ */
+static void add_backend( )
+{
+   static bool  added;
+
+   if ( added )
+      return;
+
+   std::filesystem::path  dir = git_dir;
+   dir /= "xcrypt/objects";
+
+   auto  self = new Stream_backend{ };
+
+   auto  ret = git_odb_init_backend( &self->parent, GIT_ODB_BACKEND_VERSION );
+   git_ensure( ret );
+
+   ret = git_odb_backend_pack( &self->pack, dir.c_str( ) );
+   git_ensure( ret );
+
+   self->parent.writepack = &backend_writepack;
+   self->parent.free      = &backend_free;
+
+   // 高于默认的 pack (2) 与松散对象 (1) backend
+   ret = git_odb_add_backend( odb, &self->parent, 100 );
+   git_ensure( ret );
+
+   added = true;
+}
+
+
+
+/**
+ * 下载前已有的 pack 索引, 没有调用 fetch_pack_begin 时为空
+ */
+static std::optional< std::set< std::filesystem::path > >   old_packs;
+
+
+
+static std::set< std::filesystem::path > list_packs( )
+{
+   std::set< std::filesystem::path >  packs;
+
+   std::filesystem::path  dir = git_dir;
+   dir /= "xcrypt/objects/pack";
+
+   std::error_code  ec;
+   for ( auto &entry : std::filesystem::directory_iterator( dir, ec ) )
+   {
+      if ( entry.path( ).extension( ) == ".idx" )
+         packs.emplace( entry.path( ) );
+   }
+
+   return packs;
+}
+
+
+
+struct pack_index_head
+{
+   char                             magic[4];
+   boost::endian::big_uint32_t      version;
+   boost::endian::big_uint32_t      fanout[256];
+};
+
+static_assert( sizeof( pack_index_head ) == 8 + 256 * 4 );
+
+
+
+/**
+ * 读取 pack 索引 (第 2 版) 中的对象, 按在 pack 中的偏移排序后加入 oids, 不是第 2 版时返回 false
+ */
+static bool read_pack_index( Oid_vec &oids, const std::filesystem::path &path )
+{
+   boost::interprocess::file_mapping    file( path.c_str( ), boost::interprocess::read_only );
+   boost::interprocess::mapped_region   region( file, boost::interprocess::read_only );
+
+   auto  ptr = static_cast< const uint8_t * >( region.get_address( ) );
+   auto  len = region.get_size( );
+
+   if ( len < sizeof( pack_index_head ) )
+      return false;
+
+   auto  &head = *reinterpret_cast< const pack_index_head * >( ptr );
+   if ( ( memcmp( head.magic, "\377tOc", 4 ) != 0 ) || ( head.version != 2 ) )
+      return false;
+
+   size_t  n = head.fanout[255];
+
+   // oid, crc32, 4 字节偏移, 之后是 8 字节的大偏移表, 最后是 pack 与索引的 sha1
+   auto  names   = ptr + sizeof( head );
+   auto  offsets = reinterpret_cast< const boost::endian::big_uint32_t * >( names + n * ( GIT_OID_RAWSZ + 4 ) );
+   auto  large   = reinterpret_cast< const boost::endian::big_uint64_t * >( offsets + n );
+
+   ensure( len >= ( sizeof( head ) + n * ( GIT_OID_RAWSZ + 4 + 4 ) + 2 * GIT_OID_RAWSZ ) );
+
+   size_t  large_count = ( len - ( reinterpret_cast< const uint8_t * >( large ) - ptr ) - 2 * GIT_OID_RAWSZ ) / 8;
+
+   std::vector< std::pair< uint64_t, size_t > >  order( n );
+
+   for ( size_t i = 0; i < n; ++i )
+   {
+      uint64_t  off = offsets[i];
+
+      if ( off & 0x80000000u )
+      {
+         off &= 0x7fffffffu;
+         ensure( off < large_count );
+
+         off = large[off];
+      }
+
+      order[i] = { off, i };
+   }
+
+   std::sort( order.begin( ), order.end( ) );
+
+   for ( auto &[off, i] : order )
+      git_oid_fromraw( &oids.emplace_back( ), names + i * GIT_OID_RAWSZ );
+
+   trace( "fetch pack     ", n, " objects ", path.filename( ).string( ) );
+
+   return true;
+}
+
+
+
+/**
+ * 本次下载得到的 pack 中的全部对象, 按在 pack 中的偏移排序
+ * 没有调用 fetch_pack_begin, 或者找不到新的 pack 时返回 false, 此时只能以 revwalk 确定要解密的对象
+ */
+bool fetch_pack_objects( Oid_vec &oids )
+{
+   if ( !old_packs.has_value( ) )
+      return false;
+
+   auto  old = std::move( *old_packs );
+   old_packs.reset( );
+
+   bool  found = false;
+
+   for ( auto &path : list_packs( ) )
+   {
+      if ( old.contains( path ) )
+         continue;
+
+      if ( !read_pack_index( oids, path ) )
+         return false;
+
+      found = true;
+   }
+
+   return found;
+}
+
+
+
+/**
+ * 开始下载前调用, 记录已有的 pack, 下载后由 fetch_pack_objects 找出新下载的 pack
+ */
+void fetch_pack_begin( )
+{
+   old_packs = list_packs( );
+}
+
+
+
+/**
+ * 开始下载前调用, 之后下载的 pack 边下载边解密, 解密得到的明文写入同一个 pack
+ */
+void fetch_stream_begin( )
+{
+   ensure( fetch_stream == nullptr );
+
+   add_backend( );
+
+   fetch_pack_begin( );
+
+   pack_writer_begin( false );
+
+   fetch_stream = std::make_unique< Fetch_stream >( );
+}
+
+
+
+/**
+ * 下载完成后调用, 等待后台线程处理完已收到的数据, 返回解密的对象数
+ */
+size_t fetch_stream_end( )
+{
+   ensure( fetch_stream != nullptr );
+
+   auto  count = fetch_stream->finish( );
+   fetch_stream.reset( );
+
+   pack_writer_end( );
+
+   auto  ret = git_odb_refresh( odb );
+   git_ensure( ret );
+
+   trace( "fetch stream   ", count, " objects decrypted" );
+
+   return count;
+}
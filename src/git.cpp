@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <unistd.h>
+
 #include "common.h"
 
 
@@ -24,10 +26,315 @@ void repo_close( )
       return;
 
    git_odb_free( odb );
+   git_odb_free( plain_odb );
+   git_repository_free( xrepo );
    git_repository_free( repo );
 
-   repo = nullptr;
-   odb  = nullptr;
+   repo      = nullptr;
+   xrepo     = nullptr;
+   odb       = nullptr;
+   plain_odb = nullptr;
+}
+
+
+
+/**
+ * 密文仓库
+ *
+ * 密文对象与 refs/xcrypt/ 下的引用, 都保存在 .git/xcrypt 这个裸仓库中, 普通的 git 命令看不到它们,
+ * 主仓库的 gc, repack, fsck, count-objects 都不再处理密文
+ *
+ * 密文仓库以 alternates 引用主仓库的对象库, 因此 odb 可以同时读取明文与密文, 但只写入密文仓库,
+ * 解密得到的明文通过 plain_odb 写入主仓库
+ *
+ * 密文仓库中的对象既不能 delta, 也压缩不了, 在密文仓库上运行的 packbuilder (推送, 迁移, prune) 做 delta 搜索只是浪费 CPU
+ * libgit2 的 packbuilder 对大于 pack.bigFileThreshold 的对象不做 delta 搜索,
+ * 打开时在本进程的配置中加入一个 app 级别的配置文件, 将其设为 0; packbuilder 的 zlib 压缩级别固定, 无法调整
+ */
+static std::filesystem::path xrepo_path( )
+{
+   std::filesystem::path  path = git_dir;
+   path /= "xcrypt";
+   return path;
+}
+
+
+
+/**
+ * 写入一个小文件, 文件已存在时不覆盖; 多个进程并发时, 先写临时文件再改名
+ */
+static void write_once( const std::filesystem::path &path, const char *text )
+{
+   std::error_code  ec;
+   if ( std::filesystem::exists( path, ec ) )
+      return;
+
+   auto  tmp = path;
+   tmp += '.' + std::to_string( getpid( ) );
+
+   auto  fp = fopen( tmp.c_str( ), "w" );
+   ensure( fp != nullptr );
+
+   fputs( text, fp );
+   ensure( fclose( fp ) == 0 );
+
+   std::filesystem::rename( tmp, path );
+}
+
+
+
+/**
+ * 一次修改的引用达到此数量时, 提交后将松散引用打包成 packed-refs
+ */
+static constexpr size_t  REF_PACK_MIN = 64;
+
+
+
+Ref_batch::~Ref_batch( )
+{
+   if ( _tx != nullptr )
+      git_transaction_free( _tx );
+}
+
+
+
+void Ref_batch::lock( const std::string &name )
+{
+   if ( _tx == nullptr )
+   {
+      auto  ret = git_transaction_new( &_tx, _repo );
+      git_ensure( ret );
+   }
+
+   if ( !_locked.emplace( name ).second )
+      return;
+
+   auto  ret = git_transaction_lock_ref( _tx, name.c_str( ) );
+   git_ensure( ret );
+}
+
+
+
+void Ref_batch::set( const std::string &name, const git_oid &oid )
+{
+   lock( name );
+
+   auto  ret = git_transaction_set_target( _tx, name.c_str( ), &oid, nullptr, nullptr );
+   git_ensure( ret );
+}
+
+
+
+void Ref_batch::remove( const std::string &name )
+{
+   lock( name );
+
+   auto  ret = git_transaction_remove( _tx, name.c_str( ) );
+   git_ensure( ret );
+}
+
+
+
+void Ref_batch::commit( )
+{
+   if ( _tx == nullptr )
+      return;
+
+   auto  ret = git_transaction_commit( _tx );
+   git_ensure( ret );
+
+   git_transaction_free( _tx );
+   _tx = nullptr;
+
+   trace( "ref batch      ", _locked.size( ), " refs" );
+
+   if ( _locked.size( ) >= REF_PACK_MIN )
+   {
+      git_refdb  *refdb;
+
+      ret = git_repository_refdb( &refdb, _repo );
+      git_ensure( ret );
+
+      ret = git_refdb_compress( refdb );
+      git_ensure( ret );
+
+      git_refdb_free( refdb );
+   }
+
+   _locked.clear( );
+}
+
+
+
+/**
+ * 将主仓库中的一个旧引用复制到密文仓库
+ */
+static void migrate_ref( git_revwalk *walk, git_reference *ref )
+{
+   if ( git_reference_type( ref ) != GIT_REF_OID )
+      return;
+
+   auto  name = git_reference_name( ref );
+   auto  oid  = git_reference_target( ref );
+
+   git_reference  *new_ref;
+   auto  ret = git_reference_create( &new_ref, xrepo, name, oid, 1, nullptr );
+   git_ensure( ret );
+   git_reference_free( new_ref );
+
+   // 指向的对象可能已经不存在
+   if ( git_odb_exists( odb, oid ) )
+   {
+      ret = git_revwalk_push( walk, oid );
+      git_ensure( ret );
+   }
+
+   trace( "migrate ref    ", name );
+}
+
+
+
+/**
+ * 旧版本将密文与 refs/xcrypt/ 引用保存在主仓库中
+ * 引用移入密文仓库, 引用可达的密文对象复制为密文仓库中的一个 pack, 之后主仓库中的密文由 git gc 作为不可达对象清理
+ */
+static void xrepo_migrate( )
+{
+   git_revwalk  *walk;
+
+   auto  ret = git_revwalk_new( &walk, xrepo );
+   git_ensure( ret );
+
+   std::vector< git_reference * >  refs;
+   git_reference_iterator         *itr;
+
+   ret = git_reference_iterator_glob_new( &itr, repo, "refs/xcrypt/*" );
+   git_ensure( ret );
+
+   git_reference  *ref;
+   while ( git_reference_next( &ref, itr ) == 0 )
+   {
+      migrate_ref( walk, ref );
+      refs.emplace_back( ref );
+   }
+
+   git_reference_iterator_free( itr );
+
+   git_packbuilder  *pb;
+
+   ret = git_packbuilder_new( &pb, xrepo );
+   git_ensure( ret );
+
+   ret = git_packbuilder_insert_walk( pb, walk );
+   git_ensure( ret );
+
+   if ( git_packbuilder_object_count( pb ) > 0 )
+   {
+      auto  path = xrepo_path( ) / "objects/pack";
+
+      ret = git_packbuilder_write( pb, path.c_str( ), 0, nullptr, nullptr );
+      git_ensure( ret );
+
+      ret = git_odb_refresh( odb );
+      git_ensure( ret );
+   }
+
+   git_packbuilder_free( pb );
+   git_revwalk_free( walk );
+
+   // 复制完成后再删除主仓库中的引用, 中途失败时下次重新迁移
+   for ( auto r : refs )
+   {
+      ret = git_reference_delete( r );
+      git_ensure( ret );
+      git_reference_free( r );
+   }
+}
+
+
+
+/**
+ * 加入 pack.config, 上传密文时不做 delta 搜索
+ */
+static void xrepo_config( git_repository *r )
+{
+   auto  pack_config = xrepo_path( ) / "pack.config";
+
+   git_config  *cfg;
+
+   auto  ret = git_repository_config( &cfg, r );
+   git_ensure( ret );
+
+   ret = git_config_add_file_ondisk( cfg, pack_config.c_str( ), GIT_CONFIG_LEVEL_APP, r, 1 );
+   git_ensure( ret );
+
+   git_config_free( cfg );
+}
+
+
+
+/**
+ * 主仓库打开后, 打开 (必要时建立) 密文仓库, odb 改为密文仓库的对象库
+ */
+void xrepo_open( )
+{
+   ensure( ( repo != nullptr ) && ( xrepo == nullptr ) );
+
+   auto  ret = git_repository_odb( &plain_odb, repo );
+   git_ensure( ret );
+
+   auto  path = xrepo_path( );
+
+   if ( git_repository_open_bare( &xrepo, path.c_str( ) ) != 0 )
+   {
+      ret = git_repository_init( &xrepo, path.c_str( ), 1 );
+      git_ensure( ret );
+   }
+
+   // 相对于 .git/xcrypt/objects
+   write_once( path / "objects/info/alternates", "../../objects\n" );
+
+   ret = git_repository_odb( &odb, xrepo );
+   git_ensure( ret );
+
+   // 不修改密文仓库的 config 文件
+   write_once( path / "pack.config", "[pack]\n\tbigFileThreshold = 0\n" );
+
+   xrepo_config( xrepo );
+
+   // 只在主仓库还有旧引用时迁移
+   git_reference_iterator  *itr;
+
+   ret = git_reference_iterator_glob_new( &itr, repo, "refs/xcrypt/*" );
+   git_ensure( ret );
+
+   git_reference  *ref;
+   bool  legacy = git_reference_next( &ref, itr ) == 0;
+
+   if ( legacy )
+      git_reference_free( ref );
+
+   git_reference_iterator_free( itr );
+
+   if ( legacy )
+      xrepo_migrate( );
+}
+
+
+
+/**
+ * 另外打开一个密文仓库, 供其他线程使用, 不与 xrepo 共用缓存
+ */
+git_repository * xrepo_reopen( )
+{
+   git_repository  *r;
+
+   auto  ret = git_repository_open_bare( &r, xrepo_path( ).c_str( ) );
+   git_ensure( ret );
+
+   xrepo_config( r );
+
+   return r;
 }
 
 
@@ -45,6 +352,34 @@ std::string get_secret_key_config_name( const char *remote_name )
 
 
 
+/**
+ * 获取远程存储模式在配置中的名称
+ *
+ * 值为 pack 时使用 pack 模式, 否则 (包括未配置) 使用逐对象加密的默认模式
+ */
+std::string get_mode_config_name( const char *remote_name )
+{
+   std::string    name = "remote.";
+   name += remote_name;
+   name += ".xcrypt-mode";
+   return name;
+}
+
+
+
+/**
+ * 获取是否发布 omp 快照在配置中的名称, 见 omp_snapshot.cpp
+ */
+std::string get_snapshot_config_name( const char *remote_name )
+{
+   std::string    name = "remote.";
+   name += remote_name;
+   name += ".xcrypt-omp-snapshot";
+   return name;
+}
+
+
+
 void check_secret_key_format( const char *secret_key )
 {
    std::string_view  key( secret_key );
@@ -57,6 +392,26 @@ void check_secret_key_format( const char *secret_key )
 
 
 
+/**
+ * 读取远程的密码, 计算其 SHA3, 远程没有配置密码时返回 false
+ */
+bool get_remote_password( Password &out, git_config *cfg, const char *name )
+{
+   const char *key;
+   auto  ret = git_config_get_string( &key, cfg, get_secret_key_config_name( name ).c_str( ) );
+   if ( ret != 0 )
+      return false;
+
+   check_secret_key_format( key );
+
+   // 计算密码的 SHA256
+   sha3_256( out.md, key + 4, strlen( key + 4 ) );
+
+   return true;
+}
+
+
+
 void load_remote( const char *rename_name )
 {
    ::remote_name = rename_name;
@@ -66,17 +421,25 @@ void load_remote( const char *rename_name )
    auto  ret = git_repository_config_snapshot( &cfg, repo );
    git_ensure( ret );
 
-   // cfg name
-   auto  name = get_secret_key_config_name( remote_name );
-
    // 密码
-   const char *key;
-   ret = git_config_get_string( &key, cfg, name.c_str( ) );
-   if ( ret != 0 )
+   if ( !get_remote_password( pw, cfg, remote_name ) )
       xcrypt_abort( "Can't get remote secret key" );
 
-   check_secret_key_format( key );
+   // 存储模式
+   const char *mode;
+   auto  name = get_mode_config_name( remote_name );
+   if ( git_config_get_string( &mode, cfg, name.c_str( ) ) == 0 )
+   {
+      if ( strcmp( mode, "pack" ) == 0 )
+         pack_mode = true;
 
-   // 计算密码的 SHA256
-   sha3_256( pw.md, key + 4, strlen( key + 4 ) );
+      else if ( strcmp( mode, "object" ) != 0 )
+         xcrypt_abort( "Unknown xcrypt mode '%s'", mode );
+   }
+
+   // 推送时是否发布 omp 快照
+   int  snapshot;
+   name = get_snapshot_config_name( remote_name );
+   if ( git_config_get_bool( &snapshot, cfg, name.c_str( ) ) == 0 )
+      omp_snapshot = snapshot != 0;
 }
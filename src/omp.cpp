@@ -14,9 +14,16 @@
  * limitations under the License.
  */
 
-#include <fstream>
-#include <unordered_map>
+#include <bit>
+#include <memory>
+#include <mutex>
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/endian/arithmetic.hpp>
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 
@@ -24,18 +31,266 @@
 
 
 
-struct omp_item
+/**
+ * 加密是确定性的, 同一个密钥加密出的对象相同, 所以 omp 按密钥共用, 文件名为密钥指纹 key-<fp>
+ * 旧版本按远程名称保存为 <remote>.omp, <remote>.omj, 加载时迁移
+ *
+ * omp 由两个文件组成
+ *
+ * 1. key-<fp>.omp, 基础文件, 保存全部映射, 分页加密的有序索引 (见 omp_index.cpp), 只在压缩时重写
+ *    旧版本的基础文件是整体加密的 omp_item 数组, 加载时全部读入内存, 退出时转换为索引
+ * 2. key-<fp>.omj, 日志文件, 只追加, 新映射每满 OMP_BATCH 个写一批, 退出时写入剩余部分
+ *
+ * 日志中每一批的格式:
+ *    4 字节  小端, 密文长度 n
+ *    4 字节  小端, ~n, 用于发现写了一半的批头
+ *    n 字节  用 aes_seal 加密的 omp_item 数组
+ *
+ * 加载时依次重放日志中的每一批, 遇到不完整或校验失败的批即停止, 其后的数据在下次追加前截断,
+ * 因此程序崩溃时, 最多丢失最后一批映射
+ *
+ * 日志长度超过基础文件的 1/16 (且不小于 OMP_COMPACT_MIN) 时, 退出前将日志中的映射合并到新的基础文件, 并删除日志
+ *
+ * 多个进程可以同时使用同一个 omp, 以 key-<fp>.lock 上的 flock 协调:
+ *   追加日志, 压缩时持有排它锁, 加载时持有共享锁, 锁只在这些操作期间持有
+ *   追加和压缩前, 先读入其他进程追加的日志, 基础文件被其他进程替换时重新打开 (见 omp_catch_up)
+ *   因为追加时持有排它锁, 日志末尾不完整的批只可能来自崩溃的进程, 可以安全截断
+ *   omp_sync 在不写入时读入其他进程的新映射, 不需要重新加载
+ *
+ * 内存中的 omp 只保存日志中的映射, 新映射, 以及从索引中查到的映射, 见 Omp_table
+ *
+ * omp_find 只返回映射对象仍然存在的映射, 确认存在后记录在映射的标志中, 本次运行中不再重复检查,
+ * 对象可能被删除时 (例如 gc), 调用 omp_refresh 清除这些标志
+ */
+
+
+
+struct omp_batch_head
 {
-   Raw_oid  k;
-   Raw_oid  v;
+   boost::endian::little_uint32_t   size;
+   boost::endian::little_uint32_t   check;
 };
 
-static_assert( sizeof( omp_item ) == 64 );
+static_assert( sizeof( omp_batch_head ) == 8 );
+
+
+
+/**
+ * 每批写入日志的映射数
+ */
+static constexpr size_t  OMP_BATCH = 4096;
+
+
+/**
+ * 日志压缩的最小长度
+ */
+static constexpr size_t  OMP_COMPACT_MIN = 1024 * 1024;
+
+
+
+namespace
+{
+   /**
+    * 内存中的 omp
+    *
+    * 每个映射只保存一份 Omp_pair, 按插入顺序存放在分段数组中, 插入后地址不再改变
+    * 另有两个开放寻址的索引数组, 分别以 plain, cipher 为键, 槽中保存映射的序号 + 1, 0 表示空槽
+    *
+    * 写入由互斥锁串行化, 读取不加锁:
+    *   映射写好之后才以 release 写入索引槽, 读者以 acquire 读取索引槽
+    *   扩容时建好新的索引数组再整体发布, 旧的索引数组保留到程序退出, 正在读旧数组的读者不受影响
+    */
+   class Omp_table
+   {
+      static constexpr size_t  SEG_BITS = 16;
+      static constexpr size_t  SEG_SIZE = size_t( 1 ) << SEG_BITS;
+      static constexpr size_t  SEG_MAX  = size_t( 1 ) << 14;
+
+      struct Index
+      {
+         Index( size_t capacity )
+            : mask( capacity - 1 )
+         {
+            for ( auto &s : slots )
+               s = std::make_unique< std::atomic< uint32_t >[] >( capacity );
+         }
+
+         size_t                                           mask;
+         std::unique_ptr< std::atomic< uint32_t >[] >     slots[2];
+      };
+
+   public:
+      Omp_pair * find( const git_oid &oid ) const
+      {
+         auto  index = _index.load( std::memory_order_acquire );
+         if ( index == nullptr )
+            return nullptr;
+
+         auto  pair = probe( *index, 0, oid );
+         if ( pair == nullptr )
+            pair = probe( *index, 1, oid );
+
+         return pair;
+      }
+
+
+      /**
+       * 插入映射, plain 已存在时返回已有的映射
+       */
+      Omp_pair * insert( const git_oid &plain, const git_oid &cipher, bool &inserted )
+      {
+         std::lock_guard  lock( _mutex );
+
+         auto  pair = find( plain );
+         if ( pair != nullptr )
+         {
+            inserted = false;
+            return pair;
+         }
+
+         auto  n = _size.load( std::memory_order_relaxed );
+         ensure( ( n >> SEG_BITS ) < SEG_MAX );
+
+         reserve_locked( n + 1 );
+
+         auto  &seg = _segs[n >> SEG_BITS];
+         if ( seg == nullptr )
+            seg = std::make_unique< Omp_pair[] >( SEG_SIZE );
+
+         pair = &seg[n & ( SEG_SIZE - 1 )];
+         pair->plain  = plain;
+         pair->cipher = cipher;
+
+         _size.store( n + 1, std::memory_order_release );
+
+         auto  &index = *_index.load( std::memory_order_relaxed );
+         place( index, 0, plain,  n + 1 );
+         place( index, 1, cipher, n + 1 );
+
+         inserted = true;
+         return pair;
+      }
+
+
+      /**
+       * 预留 n 个映射的索引空间, 避免加载时反复扩容
+       */
+      void reserve( size_t n )
+      {
+         std::lock_guard  lock( _mutex );
+         reserve_locked( n );
+      }
+
+
+      size_t size( ) const
+      {
+         return _size.load( std::memory_order_acquire );
+      }
+
+
+      Omp_pair & operator [] ( size_t n ) const
+      {
+         return _segs[n >> SEG_BITS][n & ( SEG_SIZE - 1 )];
+      }
+
+   private:
+      static size_t hash( const git_oid &oid )
+      {
+         return std::hash< git_oid >( )( oid );
+      }
+
+
+      Omp_pair * probe( const Index &index, int side, const git_oid &oid ) const
+      {
+         auto  &slots = index.slots[side];
+
+         for ( auto i = hash( oid ) & index.mask; ; i = ( i + 1 ) & index.mask )
+         {
+            auto  v = slots[i].load( std::memory_order_acquire );
+            if ( v == 0 )
+               return nullptr;
+
+            auto  &pair = ( *this )[v - 1];
+            if ( ( side == 0 ? pair.plain : pair.cipher ) == oid )
+               return &pair;
+         }
+      }
+
+
+      static void place( Index &index, int side, const git_oid &oid, size_t v )
+      {
+         auto  &slots = index.slots[side];
+
+         auto  i = hash( oid ) & index.mask;
+         while ( slots[i].load( std::memory_order_relaxed ) != 0 )
+            i = ( i + 1 ) & index.mask;
+
+         slots[i].store( static_cast< uint32_t >( v ), std::memory_order_release );
+      }
+
+
+      void reserve_locked( size_t n )
+      {
+         auto  index = _index.load( std::memory_order_relaxed );
+
+         // 装载率不超过 1/2
+         if ( ( index != nullptr ) && ( ( n * 2 ) <= ( index->mask + 1 ) ) )
+            return;
+
+         auto  ni = std::make_unique< Index >( std::max< size_t >( 1024, std::bit_ceil( n * 2 ) ) );
+
+         auto  size = _size.load( std::memory_order_relaxed );
+         for ( size_t i = 0; i < size; ++i )
+         {
+            place( *ni, 0, ( *this )[i].plain,  i + 1 );
+            place( *ni, 1, ( *this )[i].cipher, i + 1 );
+         }
+
+         _index.store( ni.get( ), std::memory_order_release );
+         _retired.emplace_back( std::move( ni ) );
+      }
+
+   private:
+      std::unique_ptr< Omp_pair[] >             _segs[SEG_MAX];
+      std::atomic< size_t >                     _size{ };
+      std::atomic< Index * >                    _index{ };
+      std::vector< std::unique_ptr< Index > >   _retired;
+      std::mutex                                _mutex;
+   };
+}
+
+
+
+static Omp_table   omp;
+
+
+/**
+ * 尚未写入日志的新映射
+ */
+static std::vector< omp_item >   pending;
 
 
+static size_t     journal_size;
+static int        journal_fd = -1;
+static ino_t      journal_ino;
 
-static std::unordered_map< git_oid, const git_oid >   omp;
-static bool                                           modified;
+
+/**
+ * 当前打开的基础文件, 用于发现其他进程的压缩
+ */
+static ino_t      base_ino;
+
+
+/**
+ * 基础文件是旧格式, 退出时需要转换为索引
+ */
+static bool       legacy;
+
+
+/**
+ * 已迁移到内存中的旧文件, 压缩后删除
+ */
+static std::vector< std::filesystem::path >   obsolete;
 
 
 static std::filesystem::path omp_dir( )
@@ -47,7 +302,105 @@ static std::filesystem::path omp_dir( )
 
 
 
+/**
+ * 密钥指纹, 只用于区分不同的密钥
+ */
+static std::string omp_key_id( )
+{
+   static constexpr char  domain[] = "xcrypt-omp";
+
+   uint8_t  md[32];
+   sha3_256( md, domain, sizeof( domain ) - 1, pw.md, sizeof( pw.md ) );
+
+   char  hex[17];
+   for ( size_t i = 0; i < 8; ++i )
+      snprintf( hex + i * 2, 3, "%02x", md[i] );
+
+   return hex;
+}
+
+
+
 std::filesystem::path omp_path( )
+{
+   auto path = omp_dir( );
+   path /= "key-" + omp_key_id( ) + ".omp";
+   return path;
+}
+
+
+
+static std::filesystem::path journal_path( const std::filesystem::path &base )
+{
+   auto path = base;
+   path.replace_extension( "omj" );
+   return path;
+}
+
+
+
+static std::filesystem::path journal_path( )
+{
+   return journal_path( omp_path( ) );
+}
+
+
+
+static std::filesystem::path lock_path( )
+{
+   auto path = omp_path( );
+   path.replace_extension( "lock" );
+   return path;
+}
+
+
+
+/**
+ * 墓碑文件, 见 omp_prune
+ */
+static std::filesystem::path tombstone_path( )
+{
+   auto path = omp_path( );
+   path.replace_extension( "prn" );
+   return path;
+}
+
+
+
+/**
+ * 文件的 inode, 文件不存在时返回 0
+ */
+static ino_t file_ino( const std::filesystem::path &path )
+{
+   struct stat  st;
+   if ( ::stat( path.c_str( ), &st ) != 0 )
+      return 0;
+
+   return st.st_ino;
+}
+
+
+
+namespace
+{
+   /**
+    * omp 文件的进程间锁
+    */
+   class Omp_lock : public File_lock
+   {
+   public:
+      Omp_lock( bool exclusive )
+         : File_lock( lock_path( ), exclusive )
+      { }
+   };
+}
+
+
+
+/**
+ * 旧版本按远程名称保存的基础文件
+ */
+static std::filesystem::path remote_omp_path( )
 {
    auto path = omp_dir( );
    path /= remote_name;
@@ -57,10 +410,119 @@ std::filesystem::path omp_path( )
 
 
 
-void omp_load( )
+/**
+ * 插入映射, 返回映射以及是否是新映射
+ */
+static std::pair< Omp_pair *, bool > omp_insert_pair( const git_oid &a, const git_oid &b )
 {
-   auto  path = omp_path( );
+   bool  inserted;
+   auto  pair = omp.insert( a, b, inserted );
+
+   if ( !inserted )
+      ensure( pair->other( a ) == b );
+
+   return { pair, inserted };
+}
+
+
+
+static bool read_all( int fd, uint8_t *data, size_t size, size_t offset )
+{
+   while ( size > 0 )
+   {
+      auto  n = ::pread( fd, data, size, offset );
+      if ( n < 0 )
+      {
+         if ( errno == EINTR )
+            continue;
+
+         return false;
+      }
+
+      if ( n == 0 )
+         return false;
+
+      data   += n;
+      size   -= n;
+      offset += n;
+   }
+
+   return true;
+}
+
+
+
+/**
+ * 从 offset 开始重放日志, 返回有效数据的结尾
+ */
+static size_t journal_read( int fd, size_t offset )
+{
+   struct stat  st;
+   if ( ( ::fstat( fd, &st ) != 0 ) || ( static_cast< size_t >( st.st_size ) <= offset ) )
+      return offset;
+
+   // 日志中每个映射至少占 64 字节
+   omp.reserve( omp.size( ) + ( st.st_size - offset ) / 64 );
+
+   size_t  good = offset;
+
+   git_oid  k;
+   git_oid  v;
+
+   while ( true )
+   {
+      omp_batch_head  head;
+      if ( !read_all( fd, reinterpret_cast< uint8_t * >( &head ), sizeof( head ), good ) )
+         break;
+
+      size_t  size = head.size;
+      if ( ( head.check != static_cast< uint32_t >( ~size ) ) || ( size < 48 ) || ( ( size % 16 ) != 0 ) )
+         break;
+
+      Memory   buff( size );
+      if ( !read_all( fd, buff, size, good + sizeof( head ) ) )
+         break;
+
+      auto  sz = aes_unseal( buff, buff, size );
+      if ( ( sz == SIZE_MAX ) || ( ( sz % 64 ) != 0 ) )
+         break;
+
+      auto  itr = reinterpret_cast< omp_item * >( static_cast< uint8_t * >( buff ) );
+      auto  end = itr + ( sz / 64 );
+
+      for ( ; itr < end; ++itr )
+         omp_insert_pair( itr->k.to( k ), itr->v.to( v ) );
+
+      good += sizeof( head ) + size;
+   }
+
+   trace( "omp journal    ", offset, " -> ", good );
 
+   return good;
+}
+
+
+
+/**
+ * 重放整个日志文件
+ */
+static void journal_replay( const std::filesystem::path &path )
+{
+   auto  fd = ::open( path.c_str( ), O_RDONLY | O_CLOEXEC );
+   if ( fd < 0 )
+      return;
+
+   journal_read( fd, 0 );
+   ::close( fd );
+}
+
+
+
+/**
+ * 加载旧格式的基础文件
+ */
+static void legacy_load( const std::filesystem::path &path )
+{
    try
    {
       boost::interprocess::file_mapping   file( path.c_str( ), boost::interprocess::read_only );
@@ -69,9 +531,13 @@ void omp_load( )
       auto  data = static_cast< const uint8_t * >( rgn.get_address( ) );
       auto  size = rgn.get_size( );
 
+      legacy = true;
+
       if ( ( size % 64 ) != ( 32 + 16 ) )
          throw std::runtime_error( "omp length error" );
 
+      omp.reserve( size / 64 );
+
       //
       Memory   buff( size - 16 );
       auto  sz = aes_decrypt( buff, data, size );
@@ -95,7 +561,7 @@ void omp_load( )
       {
          itr->k.to( k );
          itr->v.to( v );
-         omp_insert( k, v );
+         omp_insert_pair( k, v );
       }
    }
    catch ( const boost::interprocess::interprocess_exception &e )
@@ -107,93 +573,759 @@ void omp_load( )
 
 
 
-std::pair< const git_oid, const git_oid > * omp_find( const git_oid &id )
+/**
+ * 迁移旧版本按远程名称保存的文件
+ *
+ * 共用的文件还不存在时直接改名, 否则 (另一个使用相同密钥的远程已经建立了 omp) 读入内存, 压缩时合并
+ */
+static bool omp_migrate_needed( )
 {
-   auto  itr = omp.find( id );
-
-   if ( itr == omp.end( ) )
-      return nullptr;
+   std::error_code  ec;
 
-   ensure( odb != nullptr );
-   if ( git_odb_exists( odb, &itr->second ) == 0 )
-      return nullptr;
+   auto  old_path = remote_omp_path( );
 
-   return &*itr;
+   return std::filesystem::exists( old_path, ec ) || std::filesystem::exists( journal_path( old_path ), ec );
 }
 
 
 
-static void omp_insert_one( const git_oid &a, const git_oid &b )
+static void omp_migrate( )
 {
-   auto  rst = omp.emplace( a, b );
+   std::error_code  ec;
 
-   if ( rst.second )
+   auto  old_path    = remote_omp_path( );
+   auto  old_journal = journal_path( old_path );
+
+   bool  has_base    = std::filesystem::exists( old_path, ec );
+   bool  has_journal = std::filesystem::exists( old_journal, ec );
+
+   if ( !has_base && !has_journal )
+      return;
+
+   auto  path = omp_path( );
+
+   trace( "omp migrate    ", old_path, " -> ", path );
+
+   if ( !std::filesystem::exists( path, ec ) && !std::filesystem::exists( journal_path( ), ec ) )
    {
-      modified = true;
+      if ( has_base )
+         std::filesystem::rename( old_path, path );
+
+      if ( has_journal )
+         std::filesystem::rename( old_journal, journal_path( ) );
+
       return;
    }
 
-   ensure( git_oid_cmp( &rst.first->second, &b ) == 0 );
+   if ( omp_index_open( old_path ) )
+   {
+      std::vector< omp_item >  items;
+      omp_index_items( items );
+      omp_index_close( );
+
+      omp.reserve( omp.size( ) + items.size( ) / 2 );
+
+      git_oid  k;
+      git_oid  v;
+
+      for ( auto &item : items )
+         omp_insert_pair( item.k.to( k ), item.v.to( v ) );
+   }
+   else
+      legacy_load( old_path );
+
+   journal_replay( old_journal );
+
+   obsolete.emplace_back( old_path );
+   obsolete.emplace_back( old_journal );
 }
 
 
 
-void omp_insert( const git_oid &a, const git_oid &b )
+static void journal_close( )
 {
-   omp_insert_one( a, b );
-   omp_insert_one( b, a );
+   if ( journal_fd >= 0 )
+   {
+      ::close( journal_fd );
+      journal_fd = -1;
+   }
+
+   journal_ino  = 0;
+   journal_size = 0;
 }
 
 
 
-void omp_store( )
+/**
+ * 读入其他进程追加的日志; 基础文件或日志被其他进程的压缩替换时, 重新打开
+ * 内存中已有的映射仍然有效, 所以不需要重新加载
+ * 调用者需持有锁
+ */
+static void omp_catch_up( )
 {
-   if ( !modified )
-      return;
+   auto  path = omp_path( );
+   auto  ino  = file_ino( path );
 
-   std::error_code  ec;
-   std::filesystem::create_directory( omp_dir( ), ec );
+   if ( ino != base_ino )
+   {
+      trace( "omp reopen     ", path );
+
+      base_ino = ino;
 
-   auto  db_path  = omp_path( );
-   auto  tmp_path = db_path;
-   tmp_path.replace_extension( "tmp" );
+      if ( omp_index_open( path ) )
+         legacy = false;
+   }
+
+   auto  jpath = journal_path( );
+   auto  jino  = file_ino( jpath );
 
-   Oid_set  set;
-   Memory   buff( ( omp.size( ) / 2 * 64 ) + 32 + 16 );
-   auto    *ptr = reinterpret_cast< omp_item * >( static_cast< uint8_t * >( buff ) );
-   auto     end = ptr + ( omp.size( ) / 2 );
+   if ( ( journal_fd >= 0 ) && ( jino != journal_ino ) )
+      journal_close( );
 
-   for ( auto &kv : omp )
+   if ( journal_fd < 0 )
    {
-      if ( set.contains( kv.first ) || ( set.contains( kv.second ) ) )
-         continue;
+      if ( jino == 0 )
+         return;
 
-      set.emplace( kv.first );
-      set.emplace( kv.second );
+      journal_fd = ::open( jpath.c_str( ), O_RDWR | O_CLOEXEC );
+      if ( journal_fd < 0 )
+         return;
 
-      ptr->k = kv.first;
-      ptr->v = kv.second;
+      struct stat  st;
+      if ( ::fstat( journal_fd, &st ) != 0 )
+      {
+         journal_close( );
+         return;
+      }
 
-      if ( ++ptr >= end )
-         break;
+      journal_ino  = st.st_ino;
+      journal_size = 0;
    }
 
-   size_t  size = reinterpret_cast< uint8_t * >( ptr ) - buff;
-   sha3_256( reinterpret_cast< uint8_t (&)[32] >( *ptr ), buff, size );
-   auto  sz = aes_encrypt( buff, buff, size + 32 );
-   ensure( sz == ( size + 32 + 16 ) );
+   journal_size = journal_read( journal_fd, journal_size );
+}
 
-   std::ofstream  os( tmp_path.c_str( ), std::ios_base::binary | std::ios_base::trunc );
-   os.write( reinterpret_cast< char * >( static_cast< uint8_t * >( buff ) ), sz );
-   os.flush( );
 
-   if ( !os )
-      xcrypt_err( "save omp db failed" );
 
-   else
-   {
-      os.close( );
+void omp_load( )
+{
+   // 只有迁移旧版本的文件时需要独占, 否则与其他进程共享
+   Omp_lock  lock( omp_migrate_needed( ) );
 
-      std::filesystem::rename( tmp_path, db_path );
+   omp_migrate( );
+
+   auto  path = omp_path( );
+
+   if ( !omp_index_open( path ) )
+      legacy_load( path );
+
+   base_ino = file_ino( path );
+
+   omp_catch_up( );
+}
+
+
+
+/**
+ * 读入其他进程新增的映射
+ */
+void omp_sync( )
+{
+   Omp_lock  lock( false );
+   omp_catch_up( );
+}
+
+
+
+/**
+ * 为即将新增的 n 个映射预留映射表, 避免逐步扩容
+ */
+void omp_reserve( size_t n )
+{
+   omp.reserve( omp.size( ) + n );
+}
+
+
+
+/**
+ * 批量模式, 用于克隆: 新映射不再每 OMP_BATCH 个写一批日志, 退出时一次合并到基础文件
+ * 程序崩溃时丢失全部新映射, 克隆本来就要重新开始
+ */
+static bool   bulk;
+
+
+
+void omp_bulk_begin( )
+{
+   bulk = true;
+
+   trace( "omp bulk" );
+}
+
+
+
+static Omp_pair * omp_lookup( const git_oid &id )
+{
+   auto  pair = omp.find( id );
+
+   if ( pair == nullptr )
+   {
+      git_oid  v;
+      if ( !omp_index_find( id, v ) )
+         return nullptr;
+
+      pair = omp_insert_pair( id, v ).first;
+   }
+
+   return pair;
+}
+
+
+
+/**
+ * 映射到的对象, 即 id 的另一边是否存在
+ */
+static bool omp_exists( Omp_pair *pair, const git_oid &id )
+{
+   uint8_t  flag = ( id == pair->plain ) ? Omp_pair::CIPHER_EXISTS : Omp_pair::PLAIN_EXISTS;
+
+   if ( ( pair->flags.load( std::memory_order_acquire ) & flag ) != 0 )
+      return true;
+
+   ensure( odb != nullptr );
+   if ( git_odb_exists( odb, &pair->other( id ) ) == 0 )
+   {
+      // 被 prune 删除的密文, 映射仍然可信; 不记录标志, 需要时由调用者重新生成
+      return ( flag == Omp_pair::CIPHER_EXISTS ) && omp_pruned( pair->cipher );
+   }
+
+   pair->flags.fetch_or( flag, std::memory_order_release );
+   return true;
+}
+
+
+
+Omp_pair * omp_find( const git_oid &id )
+{
+   auto  pair = omp_lookup( id );
+
+   if ( ( pair == nullptr ) || !omp_exists( pair, id ) )
+      return nullptr;
+
+   return pair;
+}
+
+
+
+/**
+ * 批量确认 oids 映射到的对象是否存在, 结果记录在映射中, 之后的 omp_find 不再检查
+ *
+ * 按要检查的对象 (映射的另一边) 排序后依次检查, 使 pack 索引的访问顺序单调, 减少缺页和缓存失效
+ */
+void omp_verify( Oid_vec &oids )
+{
+   std::vector< std::pair< Omp_pair *, const git_oid * > >   probes;
+
+   for ( auto &id : oids )
+   {
+      auto  pair = omp_lookup( id );
+      if ( pair != nullptr )
+         probes.emplace_back( pair, &id );
+   }
+
+   std::sort( probes.begin( ), probes.end( ),
+      []( const auto &a, const auto &b )
+      {
+         return git_oid_cmp( &a.first->other( *a.second ), &b.first->other( *b.second ) ) < 0;
+      } );
+
+   size_t  n = 0;
+
+   for ( auto &[pair, id] : probes )
+   {
+      if ( omp_exists( pair, *id ) )
+         ++n;
+   }
+
+   trace( "omp verify     ", n, "/", oids.size( ) );
+}
+
+
+
+/**
+ * 本次运行中处理过的映射, k 为 plain
+ */
+void omp_visited( std::vector< omp_item > &items )
+{
+   for ( size_t i = 0, n = omp.size( ); i < n; ++i )
+   {
+      auto  &pair = omp[i];
+      if ( !pair.visited( ) )
+         continue;
+
+      auto  &item = items.emplace_back( );
+      item.k = pair.plain;
+      item.v = pair.cipher;
+   }
+}
+
+
+
+/**
+ * 重新扫描对象库, 并清除所有对象存在的标志
+ */
+void omp_refresh( )
+{
+   ensure( odb != nullptr );
+
+   auto  ret = git_odb_refresh( odb );
+   git_ensure( ret );
+
+   for ( size_t i = 0, n = omp.size( ); i < n; ++i )
+      omp[i].flags.fetch_and( static_cast< uint8_t >( ~( Omp_pair::PLAIN_EXISTS | Omp_pair::CIPHER_EXISTS ) ) );
+}
+
+
+
+/**
+ * 插入 plain -> cipher 的映射, flags 为已确认存在的对象
+ */
+static Omp_pair * omp_record( const git_oid &plain, const git_oid &cipher, uint8_t flags )
+{
+   auto  [pair, inserted] = omp_insert_pair( plain, cipher );
+
+   pair->flags.fetch_or( flags );
+
+   if ( !inserted )
+      return pair;
+
+   // 基础文件中已有, 无需再写日志
+   git_oid  v;
+   if ( omp_index_find( plain, v ) )
+   {
+      ensure( v == cipher );
+      return pair;
+   }
+
+   auto  &item = pending.emplace_back( );
+   item.k = plain;
+   item.v = cipher;
+
+   // 写日志失败时 pending 不清空, 到下一个 OMP_BATCH 的整数倍时才重试, 不是每次插入都重试
+   if ( !bulk && ( ( pending.size( ) % OMP_BATCH ) == 0 ) )
+      omp_flush( );
+
+   return pair;
+}
+
+
+
+/**
+ * 插入 plain -> cipher 的映射, 调用者刚刚写入了两边的对象
+ */
+Omp_pair * omp_insert( const git_oid &plain, const git_oid &cipher )
+{
+   return omp_record( plain, cipher, Omp_pair::PLAIN_EXISTS | Omp_pair::CIPHER_EXISTS );
+}
+
+
+
+/**
+ * 导入其他人生成的映射 (例如远程的 omp 快照), 两边的对象未必在本地, 由 omp_exists 检查
+ */
+Omp_pair * omp_import( const git_oid &plain, const git_oid &cipher )
+{
+   return omp_record( plain, cipher, 0 );
+}
+
+
+
+static bool write_all( int fd, const uint8_t *data, size_t size )
+{
+   while ( size > 0 )
+   {
+      auto  n = ::write( fd, data, size );
+      if ( n < 0 )
+      {
+         if ( errno == EINTR )
+            continue;
+
+         return false;
+      }
+
+      data += n;
+      size -= n;
+   }
+
+   return true;
+}
+
+
+
+/**
+ * 被 prune 删除的密文, 文件为 oid 的原始字节依次排列, 第一次查询时读入
+ */
+static Oid_set    tombstones;
+static bool       tombstones_loaded;
+
+
+
+static void tombstone_load( )
+{
+   if ( tombstones_loaded )
+      return;
+
+   tombstones_loaded = true;
+
+   auto  fd = ::open( tombstone_path( ).c_str( ), O_RDONLY | O_CLOEXEC );
+   if ( fd < 0 )
+      return;
+
+   struct stat  st;
+   ensure( ::fstat( fd, &st ) == 0 );
+
+   size_t  size = st.st_size - ( st.st_size % GIT_OID_RAWSZ );
+   std::vector< uint8_t >  buff( size );
+
+   if ( !read_all( fd, buff.data( ), size, 0 ) )
+      xcrypt_abort( "read omp tombstones failed: %s", strerror( errno ) );
+
+   ::close( fd );
+
+   git_oid  oid;
+   for ( size_t i = 0; i < size; i += GIT_OID_RAWSZ )
+   {
+      git_oid_fromraw( &oid, buff.data( ) + i );
+      tombstones.emplace( oid );
+   }
+
+   trace( "omp tombstones ", tombstones.size( ) );
+}
+
+
+
+/**
+ * 密文是否已被 prune 删除, 被删除的密文的映射仍然有效
+ */
+bool omp_pruned( const git_oid &cipher )
+{
+   tombstone_load( );
+   return tombstones.contains( cipher );
+}
+
+
+
+/**
+ * 记录被 prune 删除的密文
+ */
+void omp_tombstone( const Oid_vec &oids )
+{
+   Omp_lock  lock( true );
+
+   // 其他进程可能也写过
+   tombstones.clear( );
+   tombstones_loaded = false;
+   tombstone_load( );
+
+   for ( auto &oid : oids )
+      tombstones.emplace( oid );
+
+   std::vector< uint8_t >  buff;
+   buff.reserve( tombstones.size( ) * GIT_OID_RAWSZ );
+
+   for ( auto &oid : tombstones )
+      buff.insert( buff.end( ), oid.id, oid.id + GIT_OID_RAWSZ );
+
+   auto  path = tombstone_path( );
+   auto  tmp  = path;
+   tmp.replace_extension( "prn.tmp" );
+
+   auto  fd = ::open( tmp.c_str( ), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+   if ( fd < 0 )
+      xcrypt_abort( "save omp tombstones failed: %s", strerror( errno ) );
+
+   bool  succ = write_all( fd, buff.data( ), buff.size( ) ) && ( ::fsync( fd ) == 0 );
+   ::close( fd );
+
+   if ( !succ )
+      xcrypt_abort( "save omp tombstones failed: %s", strerror( errno ) );
+
+   std::filesystem::rename( tmp, path );
+}
+
+
+
+/**
+ * 将尚未保存的新映射作为一批, 追加到日志
+ */
+void omp_flush( )
+{
+   if ( pending.empty( ) )
+      return;
+
+   Omp_lock  lock( true );
+
+   omp_catch_up( );
+
+   if ( journal_fd < 0 )
+   {
+      std::error_code  ec;
+      std::filesystem::create_directory( omp_dir( ), ec );
+
+      journal_fd = ::open( journal_path( ).c_str( ), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+      if ( journal_fd < 0 )
+      {
+         xcrypt_err( "open omp journal failed: %s", strerror( errno ) );
+         return;
+      }
+
+      struct stat  st;
+      if ( ::fstat( journal_fd, &st ) != 0 )
+      {
+         xcrypt_err( "stat omp journal failed: %s", strerror( errno ) );
+         journal_close( );
+         return;
+      }
+
+      journal_ino  = st.st_ino;
+      journal_size = journal_read( journal_fd, 0 );
+   }
+
+   // 截掉崩溃的进程写了一半的批
+   if ( ( ::ftruncate( journal_fd, journal_size ) != 0 ) || ( ::lseek( journal_fd, journal_size, SEEK_SET ) < 0 ) )
+   {
+      xcrypt_err( "truncate omp journal failed: %s", strerror( errno ) );
+      journal_close( );
+      return;
+   }
+
+   auto     size = pending.size( ) * sizeof( omp_item );
+   Memory   buff( sizeof( omp_batch_head ) + size + 32 + 16 );
+
+   auto  sz = aes_seal( buff + sizeof( omp_batch_head ), reinterpret_cast< const uint8_t * >( pending.data( ) ), size );
+
+   auto  &head = *reinterpret_cast< omp_batch_head * >( static_cast< uint8_t * >( buff ) );
+   head.size  = sz;
+   head.check = static_cast< uint32_t >( ~sz );
+
+   sz += sizeof( head );
+
+   if ( !write_all( journal_fd, buff, sz ) || ( ::fdatasync( journal_fd ) != 0 ) )
+   {
+      xcrypt_err( "save omp journal failed: %s", strerror( errno ) );
+
+      // 下次追加时重新打开并截断
+      journal_close( );
+      return;
+   }
+
+   trace( "omp flush      ", pending.size( ) );
+
+   journal_size += sz;
+   pending.clear( );
+}
+
+
+
+/**
+ * 内存中的全部映射, 每个映射两个方向各一项
+ */
+static std::vector< omp_item > memory_items( )
+{
+   std::vector< omp_item >    items;
+   items.reserve( omp.size( ) * 2 );
+
+   for ( size_t i = 0, n = omp.size( ); i < n; ++i )
+   {
+      auto  &pair = omp[i];
+
+      auto  &a = items.emplace_back( );
+      a.k = pair.plain;
+      a.v = pair.cipher;
+
+      auto  &b = items.emplace_back( );
+      b.k = pair.cipher;
+      b.v = pair.plain;
+   }
+
+   return items;
+}
+
+
+
+static void sort_items( std::vector< omp_item > &items )
+{
+   std::sort( items.begin( ), items.end( ),
+      []( const omp_item &a, const omp_item &b )
+      {
+         return a.k.cmp( b.k ) < 0;
+      } );
+}
+
+
+
+/**
+ * 将排好序的 items 写成新的基础文件 (merge 为 true 时与当前基础文件合并), 并删除日志
+ * 调用者需持有排它锁, 并已读入全部日志
+ */
+static bool omp_write( std::vector< omp_item > &items, bool merge )
+{
+   std::error_code  ec;
+   std::filesystem::create_directory( omp_dir( ), ec );
+
+   auto  succ = merge ? omp_index_merge( omp_path( ), items ) : omp_index_rewrite( omp_path( ), items );
+   if ( !succ )
+   {
+      xcrypt_err( "save omp db failed" );
+      return false;
+   }
+
+   base_ino = file_ino( omp_path( ) );
+
+   journal_close( );
+   std::filesystem::remove( journal_path( ), ec );
+
+   legacy = false;
+
+   for ( auto &path : obsolete )
+      std::filesystem::remove( path, ec );
+
+   obsolete.clear( );
+
+   return true;
+}
+
+
+
+/**
+ * 将内存中的映射合并到新的基础文件, 并删除日志
+ */
+static bool omp_compact( )
+{
+   Omp_lock  lock( true );
+
+   omp_catch_up( );
+
+   auto  items = memory_items( );
+   sort_items( items );
+
+   return omp_write( items, true );
+}
+
+
+
+/**
+ * 只保留至少有一边在 keep 中的映射, 重写基础文件并删除日志
+ * dropped 返回被丢弃的项, 每个映射有两个方向的两项
+ */
+bool omp_retain( const Oid_set &keep, std::vector< omp_item > &dropped )
+{
+   omp_flush( );
+
+   if ( !pending.empty( ) )
+      return false;
+
+   Omp_lock  lock( true );
+
+   omp_catch_up( );
+
+   auto  items = memory_items( );
+
+   std::vector< omp_item >  base;
+   omp_index_items( base );
+   items.insert( items.end( ), base.begin( ), base.end( ) );
+   base = std::vector< omp_item >( );
+
+   sort_items( items );
+
+   auto  last = std::unique( items.begin( ), items.end( ),
+      []( const omp_item &a, const omp_item &b )
+      {
+         return a.k.cmp( b.k ) == 0;
+      } );
+
+   items.erase( last, items.end( ) );
+
+   // 映射的两项同时保留或同时丢弃
+   std::vector< omp_item >  kept;
+   git_oid  k;
+   git_oid  v;
+
+   for ( auto &item : items )
+   {
+      if ( keep.contains( item.k.to( k ) ) || keep.contains( item.v.to( v ) ) )
+         kept.emplace_back( item );
+      else
+         dropped.emplace_back( item );
+   }
+
+   trace( "omp gc         ", kept.size( ), " kept, ", dropped.size( ), " dropped" );
+
+   return omp_write( kept, false );
+}
+
+
+
+void omp_store( )
+{
+   // 批量模式下, 新映射不经过日志, 直接合并到基础文件, 失败时再写日志
+   if ( bulk && !pending.empty( ) && omp_compact( ) )
+   {
+      trace( "omp bulk store ", pending.size( ) );
+
+      pending.clear( );
+      return;
+   }
+
+   omp_flush( );
+
+   if ( !pending.empty( ) )
+      return;
+
+   if ( !legacy && obsolete.empty( ) && ( journal_size < std::max( omp_index_size( ) / 16, OMP_COMPACT_MIN ) ) )
+      return;
+
+   omp_compact( );
+}
+
+
+
+/**
+ * 删除当前远程的 omp 文件
+ * shared 为 true 时, 同时删除按密钥共用的文件, 调用者需确认没有其他远程使用同一个密钥
+ */
+void omp_clear( bool shared )
+{
+   std::unique_ptr< Omp_lock >  lock;
+   if ( shared )
+      lock = std::make_unique< Omp_lock >( true );
+
+   std::error_code  ec;
+
+   std::vector< std::filesystem::path >  paths{ remote_omp_path( ) };
+
+   if ( shared )
+   {
+      paths.emplace_back( omp_path( ) );
+
+      std::filesystem::remove( tombstone_path( ), ec );
+      ensure( ec == std::error_code( ) );
+   }
+
+   for ( auto &path : paths )
+   {
+      trace( "delete omp : ", path );
+
+      std::filesystem::remove( path, ec );
+      ensure( ec == std::error_code( ) );
+
+      std::filesystem::remove( journal_path( path ), ec );
+      ensure( ec == std::error_code( ) );
+   }
+
+   if ( shared )
+   {
+      std::filesystem::remove( lock_path( ), ec );
+      ensure( ec == std::error_code( ) );
    }
 }
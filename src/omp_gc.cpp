@@ -0,0 +1,567 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+
+
+
+/**
+ * omp 的垃圾回收
+ *
+ * 从主仓库与密文仓库的所有引用出发, 找出所有可达的对象,
+ * 两边都不可达的映射被丢弃, 剩余的映射重写为新的基础文件
+ *
+ * aggressive 时, 同时删除被丢弃映射的密文对象, 只删除松散对象, pack 中的对象由密文仓库的 git gc 处理
+ * 删除前先解密密文首尾, 确认其确实是另一边的密文, 不会误删明文对象
+ */
+
+
+
+/**
+ * 树中的子树与 blob, 不含子模块
+ */
+static void get_tree_entries( Oid_vec &trees, Oid_vec &blobs, git_odb_object *obj )
+{
+   auto  sv = to_sv( obj );
+
+   while ( !sv.empty( ) )
+   {
+      char  *sp;
+      auto   mode = strtoul( sv.data( ), &sp, 8 );
+      ensure( *sp == ' ' );
+
+      auto  nul = sv.find( '\0', sp + 1 - sv.data( ) );
+      ensure( nul != sv.npos );
+      ++nul;
+
+      ensure( sv.size( ) >= ( nul + GIT_OID_RAWSZ ) );
+
+      auto  raw = reinterpret_cast< const uint8_t * >( sv.data( ) ) + nul;
+
+      if ( mode == GIT_FILEMODE_TREE )
+         git_oid_fromraw( &trees.emplace_back( ), raw );
+
+      else if ( mode != GIT_FILEMODE_COMMIT )
+         git_oid_fromraw( &blobs.emplace_back( ), raw );
+
+      sv.remove_prefix( nul + GIT_OID_RAWSZ );
+   }
+}
+
+
+
+static int push_ref( git_reference *ref, void *payload )
+{
+   auto  walk = static_cast< git_revwalk * >( payload );
+
+   // 不指向提交的引用被忽略
+   git_object  *obj;
+   if ( git_reference_peel( &obj, ref, GIT_OBJ_COMMIT ) == 0 )
+   {
+      auto  ret = git_revwalk_push( walk, git_object_id( obj ) );
+      git_ensure( ret );
+
+      git_object_free( obj );
+   }
+
+   git_reference_free( ref );
+   return 0;
+}
+
+
+
+/**
+ * 所有引用可达的对象
+ */
+static void mark_reachable( Oid_set &set )
+{
+   git_revwalk  *walk;
+
+   // 密文仓库的对象库包含主仓库的对象
+   auto  ret = git_revwalk_new( &walk, xrepo );
+   git_ensure( ret );
+
+   ret = git_reference_foreach( repo, &push_ref, walk );
+   git_ensure( ret );
+
+   ret = git_reference_foreach( xrepo, &push_ref, walk );
+   git_ensure( ret );
+
+   if ( !git_repository_head_unborn( repo ) )
+   {
+      ret = git_revwalk_push_head( walk );
+      git_ensure( ret );
+   }
+
+   Oid_vec  trees;
+   Oid_vec  blobs;
+   Oid_vec  refs;
+   git_oid  oid;
+
+   while ( git_revwalk_next( &oid, walk ) == 0 )
+   {
+      set.emplace( oid );
+
+      git_odb_object  *obj;
+      ret = git_odb_read( &obj, odb, &oid );
+      git_ensure( ret );
+
+      refs.clear( );
+      get_commit_refs( refs, obj );
+      trees.emplace_back( refs[0] );
+
+      git_odb_object_free( obj );
+
+      progress( PROG_ENUMERATE, set.size( ), 0 );
+   }
+
+   git_revwalk_free( walk );
+
+   while ( !trees.empty( ) )
+   {
+      oid = trees.back( );
+      trees.pop_back( );
+
+      if ( !set.emplace( oid ).second )
+         continue;
+
+      git_odb_object  *obj;
+      if ( git_odb_read( &obj, odb, &oid ) != 0 )
+         continue;
+
+      blobs.clear( );
+      get_tree_entries( trees, blobs, obj );
+
+      git_odb_object_free( obj );
+
+      for ( auto &blob : blobs )
+         set.emplace( blob );
+
+      progress( PROG_ENUMERATE, set.size( ), 0 );
+   }
+
+   progress_end_line( );
+}
+
+
+
+/**
+ * 删除松散对象, 对象不是松散对象时返回 false
+ * 旧版本的密文保存在主仓库中, 两边都尝试
+ */
+static bool remove_loose( const git_oid &oid )
+{
+   char  hex[GIT_OID_HEXSZ + 1];
+   git_oid_tostr( hex, sizeof( hex ), &oid );
+
+   bool  removed = false;
+
+   for ( auto dir : { "xcrypt/objects", "objects" } )
+   {
+      std::filesystem::path  path = git_dir;
+      path /= dir;
+      path /= std::string_view( hex, 2 );
+      path /= hex + 2;
+
+      std::error_code  ec;
+      removed = std::filesystem::remove( path, ec ) || removed;
+   }
+
+   return removed;
+}
+
+
+
+/**
+ * 回收 omp, 返回丢弃的映射数
+ */
+size_t omp_gc( bool aggressive )
+{
+   Oid_set  reachable;
+   mark_reachable( reachable );
+
+   trace( "omp gc         ", reachable.size( ), " reachable objects" );
+
+   std::vector< omp_item >  dropped;
+   if ( !omp_retain( reachable, dropped ) )
+      xcrypt_abort( "omp gc failed" );
+
+   if ( aggressive )
+   {
+      size_t  removed = 0;
+      size_t  packed  = 0;
+
+      git_oid  k;
+      git_oid  v;
+      git_oid  plain;
+
+      // 每个映射有两项, 只处理 k 是密文的那一项
+      for ( auto &item : dropped )
+      {
+         size_t     size;
+         git_otype  otype;
+
+         item.k.to( k );
+         item.v.to( v );
+
+         if ( !omp_cipher_origin( plain, size, otype, k ) || !( plain == v ) )
+            continue;
+
+         if ( otype == GIT_OBJ_TREE )
+         {
+            // 加密树的最后一项是保存树自身密文的 blob, 只被这棵树引用
+            git_odb_object  *obj;
+            if ( git_odb_read( &obj, odb, &k ) == 0 )
+            {
+               auto  sv = to_sv( obj );
+
+               git_oid  blob;
+               git_oid_fromraw( &blob, reinterpret_cast< const uint8_t * >( sv.data( ) ) + sv.size( ) - GIT_OID_RAWSZ );
+
+               git_odb_object_free( obj );
+
+               if ( !reachable.contains( blob ) )
+               {
+                  if ( remove_loose( blob ) )
+                     ++removed;
+                  else
+                     ++packed;
+               }
+            }
+         }
+
+         if ( remove_loose( k ) )
+            ++removed;
+         else
+            ++packed;
+      }
+
+      trace( "omp gc         ", removed, " loose objects removed, ", packed, " packed" );
+
+      if ( packed > 0 )
+         fprintf( stderr, "%zu packed encrypted objects are left for 'git --git-dir=%s/xcrypt gc --prune=now'\n", packed, git_dir );
+
+      omp_refresh( );
+   }
+
+   return dropped.size( ) / 2;
+}
+
+
+
+/**
+ * 删除不再需要的本地密文
+ *
+ * 拉取时以引用可达的提交作为协商的 have, 推送时 libgit2 从远程引用所指的提交出发, 读取其树, 标记不需要上传的对象,
+ * 因此保留密文仓库引用可达的所有提交, 以及每个引用所指提交的完整的树, 其余密文全部删除
+ *
+ * 保留的对象重新打成一个 pack, 然后删除密文仓库中原有的 pack 与松散对象, 主仓库中旧版本留下的密文不处理
+ * 被删除且有映射的密文记入墓碑, 之后 omp_find 仍然信任这些映射, 不会因为密文不存在而重新加密整棵树;
+ * 推送确实需要某个已删除的密文时 (例如恢复了旧的内容), 加密过程只重新生成该对象
+ */
+
+
+
+static int push_tip( git_reference *ref, void *payload )
+{
+   auto  tips = static_cast< Oid_vec * >( payload );
+
+   git_object  *obj;
+   if ( git_reference_peel( &obj, ref, GIT_OBJ_COMMIT ) == 0 )
+   {
+      tips->emplace_back( *git_object_id( obj ) );
+      git_object_free( obj );
+   }
+
+   git_reference_free( ref );
+   return 0;
+}
+
+
+
+/**
+ * 协商需要的密文, 按写入 pack 的顺序排列: 所有提交, 然后是引用所指提交的树
+ */
+static void mark_negotiation( Oid_vec &order, Oid_set &keep )
+{
+   Oid_vec  tips;
+
+   auto  ret = git_reference_foreach( xrepo, &push_tip, &tips );
+   git_ensure( ret );
+
+   git_revwalk  *walk;
+
+   ret = git_revwalk_new( &walk, xrepo );
+   git_ensure( ret );
+
+   for ( auto &tip : tips )
+   {
+      ret = git_revwalk_push( walk, &tip );
+      git_ensure( ret );
+   }
+
+   git_oid  oid;
+
+   while ( git_revwalk_next( &oid, walk ) == 0 )
+   {
+      if ( keep.emplace( oid ).second )
+         order.emplace_back( oid );
+
+      progress( PROG_ENUMERATE, keep.size( ), 0 );
+   }
+
+   git_revwalk_free( walk );
+
+   Oid_vec  trees;
+   Oid_vec  blobs;
+   Oid_vec  refs;
+
+   for ( auto &tip : tips )
+   {
+      git_odb_object  *obj;
+      ret = git_odb_read( &obj, odb, &tip );
+      git_ensure( ret );
+
+      refs.clear( );
+      get_commit_refs( refs, obj );
+      trees.emplace_back( refs[0] );
+
+      git_odb_object_free( obj );
+   }
+
+   while ( !trees.empty( ) )
+   {
+      oid = trees.back( );
+      trees.pop_back( );
+
+      if ( !keep.emplace( oid ).second )
+         continue;
+
+      order.emplace_back( oid );
+
+      git_odb_object  *obj;
+      if ( git_odb_read( &obj, odb, &oid ) != 0 )
+         continue;
+
+      blobs.clear( );
+      get_tree_entries( trees, blobs, obj );
+
+      git_odb_object_free( obj );
+
+      for ( auto &blob : blobs )
+      {
+         if ( keep.emplace( blob ).second )
+            order.emplace_back( blob );
+      }
+
+      progress( PROG_ENUMERATE, keep.size( ), 0 );
+   }
+
+   progress_end_line( );
+}
+
+
+
+static int collect_oid( const git_oid *oid, void *payload )
+{
+   static_cast< Oid_vec * >( payload )->emplace_back( *oid );
+   return 0;
+}
+
+
+
+/**
+ * prune 与 remote helper 之间的锁, remote helper 运行期间持有共享锁, prune 持有独占锁,
+ * 使 prune 不会删除正在进行的拉取, 推送要读取的密文
+ */
+std::filesystem::path prune_lock_path( )
+{
+   std::filesystem::path  path = git_dir;
+   path /= "xcrypt/prune.lock";
+   return path;
+}
+
+
+
+/**
+ * 删除本地不再需要的密文, 返回删除的对象数
+ */
+size_t omp_prune( )
+{
+   File_lock  lock( prune_lock_path( ), true );
+
+   Oid_vec  order;
+   Oid_set  keep;
+   mark_negotiation( order, keep );
+
+   // 只包含密文仓库自身对象的对象库, 不含 alternates
+   std::filesystem::path  dir = git_dir;
+   dir /= "xcrypt/objects";
+
+   auto  pack_dir = dir / "pack";
+
+   git_odb          *db;
+   git_odb_backend  *backend;
+
+   auto  ret = git_odb_new( &db );
+   git_ensure( ret );
+
+   ret = git_odb_backend_pack( &backend, dir.c_str( ) );
+   git_ensure( ret );
+
+   ret = git_odb_add_backend( db, backend, 2 );
+   git_ensure( ret );
+
+   ret = git_odb_backend_loose( &backend, dir.c_str( ), -1, 0, 0, 0 );
+   git_ensure( ret );
+
+   ret = git_odb_add_backend( db, backend, 1 );
+   git_ensure( ret );
+
+   Oid_vec  all;
+   ret = git_odb_foreach( db, &collect_oid, &all );
+   git_ensure( ret );
+
+   // 同一对象可能同时在 pack 与松散对象中
+   std::sort( all.begin( ), all.end( ),
+      []( const git_oid &a, const git_oid &b )
+      {
+         return git_oid_cmp( &a, &b ) < 0;
+      } );
+
+   all.erase( std::unique( all.begin( ), all.end( ) ), all.end( ) );
+
+   // 只删除当前密钥映射到本地明文的密文, 记录墓碑
+   // 密文仓库的对象库由全部 xcrypt 远程共用, 当前密钥没有映射的对象可能是其他密钥的密文, 明文不在本地的密文之后还要解密, 都保留
+   Oid_vec  pruned;
+   Oid_set  removed;
+   Oid_vec  blobs;
+   Oid_vec  trees;
+
+   for ( auto &oid : all )
+   {
+      if ( keep.contains( oid ) )
+         continue;
+
+      auto  pair = omp_find( oid );
+      if ( ( pair == nullptr ) || ( pair->cipher != oid ) )
+         continue;
+
+      pruned.emplace_back( oid );
+      removed.emplace( oid );
+
+      // 加密树中保存树密文的 blob 没有映射, 随树一起删除
+      git_odb_object  *obj;
+
+      ret = git_odb_read( &obj, db, &oid );
+      git_ensure( ret );
+
+      if ( git_odb_object_type( obj ) == GIT_OBJ_TREE )
+      {
+         blobs.clear( );
+         get_tree_entries( trees, blobs, obj );
+
+         for ( auto &blob : blobs )
+         {
+            if ( !keep.contains( blob ) && ( omp_find( blob ) == nullptr ) )
+               removed.emplace( blob );
+         }
+      }
+
+      git_odb_object_free( obj );
+   }
+
+   trace( "omp prune      ", all.size( ), " objects, ", removed.size( ), " removed, ", pruned.size( ), " mapped" );
+
+   if ( removed.empty( ) )
+   {
+      git_odb_free( db );
+      return 0;
+   }
+
+   // 不删除的对象都写入新的 pack
+   for ( auto &oid : all )
+   {
+      if ( !keep.contains( oid ) && !removed.contains( oid ) )
+         order.emplace_back( oid );
+   }
+
+   // 先记录墓碑, 中途失败时最多多出一些仍然存在的墓碑
+   omp_tombstone( pruned );
+
+   // 原有的 pack, 带 .keep 的除外
+   std::vector< std::filesystem::path >  old_packs;
+   std::error_code  ec;
+
+   for ( auto &entry : std::filesystem::directory_iterator( pack_dir, ec ) )
+   {
+      auto  &path = entry.path( );
+
+      if ( ( path.extension( ) == ".pack" ) && !std::filesystem::exists( std::filesystem::path( path ).replace_extension( "keep" ), ec ) )
+         old_packs.emplace_back( path );
+   }
+
+   // 保留的对象写成新的 pack
+   git_packbuilder  *pb;
+
+   ret = git_packbuilder_new( &pb, xrepo );
+   git_ensure( ret );
+
+   for ( auto &oid : order )
+   {
+      if ( git_odb_exists( db, &oid ) )
+      {
+         ret = git_packbuilder_insert( pb, &oid, nullptr );
+         git_ensure( ret );
+      }
+   }
+
+   ret = git_packbuilder_write( pb, pack_dir.c_str( ), 0, nullptr, nullptr );
+   git_ensure( ret );
+
+   std::string  name = "pack-";
+#if LIBGIT2_NUMBER >= 10500
+   name += git_packbuilder_name( pb );
+#else
+   name += *git_packbuilder_hash( pb );
+#endif
+   name += ".pack";
+
+   git_packbuilder_free( pb );
+   git_odb_free( db );
+
+   // 删除原有的 pack 与全部松散对象
+   for ( auto &path : old_packs )
+   {
+      if ( path.filename( ) == name )
+         continue;
+
+      for ( auto ext : { "idx", "rev", "bitmap", "mtimes", "pack" } )
+         std::filesystem::remove( std::filesystem::path( path ).replace_extension( ext ), ec );
+   }
+
+   for ( auto &entry : std::filesystem::directory_iterator( dir, ec ) )
+   {
+      auto  sub = entry.path( ).filename( ).string( );
+
+      if ( ( sub.size( ) == 2 ) && isxdigit( sub[0] ) && isxdigit( sub[1] ) )
+         std::filesystem::remove_all( entry.path( ), ec );
+   }
+
+   omp_refresh( );
+
+   return removed.size( );
+}
@@ -0,0 +1,442 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/endian/arithmetic.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "common.h"
+
+
+
+/**
+ * omp 索引文件, 即 omp 的基础文件
+ *
+ * 文件格式:
+ *    64 字节                  文件头, 明文
+ *    n * PAGE_CIPHER 字节     页, 每页 PAGE_ITEMS 个按 k 排序的 omp_item, 再加 8 字节页号, 用 aes_seal 单独加密
+ *    fence_size 字节          栅栏, 每页第一个 k 组成的数组, 用 aes_seal 加密
+ *
+ * 每个映射以 a->b, b->a 两项保存, 所有项整体按 k 排序后分页, 最后一页不足时以 0 填充
+ *
+ * 文件以只读方式映射到内存, 打开时只读取文件头
+ * 第一次查找时解密栅栏, 之后每次查找只解密栅栏指向的那一页, 解密过的页缓存在内存中
+ */
+
+
+
+struct index_head
+{
+   char                             magic[8];
+   boost::endian::little_uint64_t   count;
+   boost::endian::little_uint64_t   fence;
+   boost::endian::little_uint64_t   fence_size;
+   uint8_t                          reserved[32];
+};
+
+static_assert( sizeof( index_head ) == 64 );
+
+
+
+static constexpr char    INDEX_MAGIC[8] = { 'X', 'C', 'O', 'M', 'P', 'I', 'X', '1' };
+
+static constexpr size_t  PAGE_ITEMS  = 64;
+static constexpr size_t  PAGE_PLAIN  = PAGE_ITEMS * sizeof( omp_item ) + 8;
+static constexpr size_t  PAGE_CIPHER = ( ( PAGE_PLAIN + 32 - 16 ) / 16 + 2 ) * 16;
+
+
+
+static std::unique_ptr< boost::interprocess::file_mapping >    file;
+static std::unique_ptr< boost::interprocess::mapped_region >   region;
+
+static const uint8_t    *data;
+static size_t            size;
+static size_t            count;
+static size_t            pages;
+
+static std::vector< Raw_oid >                                        fences;
+static std::unordered_map< size_t, std::unique_ptr< omp_item[] > >   page_cache;
+
+
+
+void omp_index_close( )
+{
+   page_cache.clear( );
+   fences.clear( );
+
+   region.reset( );
+   file.reset( );
+
+   data  = nullptr;
+   size  = 0;
+   count = 0;
+   pages = 0;
+}
+
+
+
+/**
+ * 打开索引文件, 文件不存在或者不是索引格式时返回 false
+ */
+bool omp_index_open( const std::filesystem::path &path )
+{
+   omp_index_close( );
+
+   try
+   {
+      auto  f = std::make_unique< boost::interprocess::file_mapping >( path.c_str( ), boost::interprocess::read_only );
+      auto  r = std::make_unique< boost::interprocess::mapped_region >( *f, boost::interprocess::read_only );
+
+      auto  ptr = static_cast< const uint8_t * >( r->get_address( ) );
+      auto  len = r->get_size( );
+
+      if ( len < sizeof( index_head ) )
+         return false;
+
+      auto  &head = *reinterpret_cast< const index_head * >( ptr );
+      if ( memcmp( head.magic, INDEX_MAGIC, sizeof( INDEX_MAGIC ) ) != 0 )
+         return false;
+
+      size_t  n = ( head.count + PAGE_ITEMS - 1 ) / PAGE_ITEMS;
+
+      if ( ( head.fence != ( sizeof( index_head ) + n * PAGE_CIPHER ) ) || ( ( head.fence + head.fence_size ) != len ) )
+         throw std::runtime_error( "omp index length error" );
+
+      file   = std::move( f );
+      region = std::move( r );
+      data   = ptr;
+      size   = len;
+      count  = head.count;
+      pages  = n;
+   }
+   catch ( const boost::interprocess::interprocess_exception &e )
+   {
+      if ( e.get_error_code( ) != boost::interprocess::not_found_error )
+         throw std::runtime_error( "omp format error" );
+
+      return false;
+   }
+
+   trace( "omp index      ", count, " items, ", pages, " pages" );
+
+   return true;
+}
+
+
+
+size_t omp_index_size( )
+{
+   return size;
+}
+
+
+
+static void load_fences( )
+{
+   auto  &head = *reinterpret_cast< const index_head * >( data );
+
+   Memory   buff( head.fence_size );
+
+   auto  sz = aes_unseal( buff, data + head.fence, head.fence_size );
+   if ( ( sz == SIZE_MAX ) || ( sz != ( pages * sizeof( Raw_oid ) ) ) )
+      throw std::runtime_error( "omp index fence checksum error" );
+
+   auto  ptr = reinterpret_cast< const Raw_oid * >( static_cast< uint8_t * >( buff ) );
+   fences.assign( ptr, ptr + pages );
+}
+
+
+
+/**
+ * 解密一页, 返回页中的有效项数
+ */
+static size_t decrypt_page( omp_item *items, size_t page )
+{
+   Memory   buff( PAGE_CIPHER );
+
+   auto  sz = aes_unseal( buff, data + sizeof( index_head ) + page * PAGE_CIPHER, PAGE_CIPHER );
+   if ( sz != PAGE_PLAIN )
+      throw std::runtime_error( "omp index page checksum error" );
+
+   // 页号也在校验范围内, 防止页被整体调换
+   uint64_t  no;
+   memcpy( &no, buff + PAGE_PLAIN - 8, 8 );
+   if ( no != page )
+      throw std::runtime_error( "omp index page number error" );
+
+   memcpy( items, buff, PAGE_PLAIN - 8 );
+
+   return std::min( PAGE_ITEMS, count - page * PAGE_ITEMS );
+}
+
+
+
+bool omp_index_find( const git_oid &key, git_oid &value )
+{
+   if ( pages == 0 )
+      return false;
+
+   if ( fences.empty( ) )
+      load_fences( );
+
+   // 最后一个首项不大于 key 的页
+   auto  itr = std::upper_bound( fences.begin( ), fences.end( ), key,
+      []( const git_oid &k, const Raw_oid &f )
+      {
+         return f.cmp( k ) > 0;
+      } );
+
+   if ( itr == fences.begin( ) )
+      return false;
+
+   size_t  page = itr - fences.begin( ) - 1;
+
+   auto  &items = page_cache[page];
+   if ( items == nullptr )
+   {
+      items = std::make_unique< omp_item[] >( PAGE_ITEMS );
+      decrypt_page( items.get( ), page );
+   }
+
+   auto  n   = std::min( PAGE_ITEMS, count - page * PAGE_ITEMS );
+   auto  end = items.get( ) + n;
+   auto  pos = std::lower_bound( items.get( ), end, key,
+      []( const omp_item &item, const git_oid &k )
+      {
+         return item.k.cmp( k ) < 0;
+      } );
+
+   if ( ( pos == end ) || ( pos->k.cmp( key ) != 0 ) )
+      return false;
+
+   pos->v.to( value );
+   return true;
+}
+
+
+
+/**
+ * 读出索引中的全部项
+ */
+void omp_index_items( std::vector< omp_item > &items )
+{
+   items.resize( count );
+
+   omp_item  page[PAGE_ITEMS];
+
+   for ( size_t p = 0; p < pages; ++p )
+   {
+      auto  n = decrypt_page( page, p );
+      std::copy_n( page, n, items.begin( ) + p * PAGE_ITEMS );
+   }
+}
+
+
+
+namespace
+{
+   /**
+    * 顺序写出索引文件
+    */
+   class Index_writer
+   {
+   public:
+      Index_writer( int fd )
+         : _fd( fd ),
+           _buff( PAGE_CIPHER )
+      {
+         // 文件头最后写
+         _offset = sizeof( index_head );
+      }
+
+
+      bool append( const omp_item &item )
+      {
+         _page[_used++] = item;
+         ++_count;
+
+         if ( _used == PAGE_ITEMS )
+            return flush( );
+
+         return true;
+      }
+
+
+      bool finish( )
+      {
+         if ( ( _used > 0 ) && !flush( ) )
+            return false;
+
+         // 栅栏
+         auto     fence_plain = _fences.size( ) * sizeof( Raw_oid );
+         Memory   buff( fence_plain + 32 + 16 );
+
+         auto  sz = aes_seal( buff, reinterpret_cast< const uint8_t * >( _fences.data( ) ), fence_plain );
+         if ( !write( buff, sz ) )
+            return false;
+
+         // 文件头
+         index_head  head{ };
+         memcpy( head.magic, INDEX_MAGIC, sizeof( INDEX_MAGIC ) );
+         head.count      = _count;
+         head.fence      = _offset - sz;
+         head.fence_size = sz;
+
+         return ::pwrite( _fd, &head, sizeof( head ), 0 ) == sizeof( head );
+      }
+
+   private:
+      bool flush( )
+      {
+         _fences.emplace_back( _page[0].k );
+
+         // 不足一页以 0 填充
+         uint8_t  plain[PAGE_PLAIN]{ };
+         memcpy( plain, _page, _used * sizeof( omp_item ) );
+
+         uint64_t  no = _fences.size( ) - 1;
+         memcpy( plain + PAGE_PLAIN - 8, &no, 8 );
+
+         auto  sz = aes_seal( _buff, plain, PAGE_PLAIN );
+         ensure( sz == PAGE_CIPHER );
+
+         _used = 0;
+
+         return write( _buff, sz );
+      }
+
+
+      bool write( const uint8_t *ptr, size_t len )
+      {
+         while ( len > 0 )
+         {
+            auto  n = ::pwrite( _fd, ptr, len, _offset );
+            if ( n < 0 )
+            {
+               if ( errno == EINTR )
+                  continue;
+
+               return false;
+            }
+
+            ptr     += n;
+            len     -= n;
+            _offset += n;
+         }
+
+         return true;
+      }
+
+   private:
+      int                     _fd;
+      Memory<>                _buff;
+      size_t                  _offset;
+      size_t                  _count{ };
+      omp_item                _page[PAGE_ITEMS];
+      size_t                  _used{ };
+      std::vector< Raw_oid >  _fences;
+   };
+}
+
+
+
+/**
+ * 将按 k 排序的 items 写成新的索引文件并替换 path, 之后重新打开
+ * merge 为 true 时与当前索引合并, 两边有相同的 k 时, 对应的 v 必须相同
+ */
+static bool index_write( const std::filesystem::path &path, std::vector< omp_item > &items, bool merge )
+{
+   auto  tmp_path = path;
+   tmp_path.replace_extension( "tmp" );
+
+   auto  fd = ::open( tmp_path.c_str( ), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+   if ( fd < 0 )
+      return false;
+
+   Index_writer   writer( fd );
+   bool           succ = true;
+
+   auto  itr = items.begin( );
+   auto  end = items.end( );
+
+   // 逐页读出当前索引, 与 items 归并
+   omp_item  page[PAGE_ITEMS];
+
+   for ( size_t p = 0; merge && succ && ( p < pages ); ++p )
+   {
+      auto  n = decrypt_page( page, p );
+
+      for ( size_t i = 0; succ && ( i < n ); ++i )
+      {
+         for ( ; succ && ( itr != end ) && ( itr->k.cmp( page[i].k ) < 0 ); ++itr )
+            succ = writer.append( *itr );
+
+         if ( ( itr != end ) && ( itr->k.cmp( page[i].k ) == 0 ) )
+         {
+            ensure( itr->v.cmp( page[i].v ) == 0 );
+            ++itr;
+         }
+
+         if ( succ )
+            succ = writer.append( page[i] );
+      }
+   }
+
+   for ( ; succ && ( itr != end ); ++itr )
+      succ = writer.append( *itr );
+
+   // 落盘后再替换, 保证任何时刻磁盘上的索引都是完整的
+   succ = succ && writer.finish( ) && ( ::fsync( fd ) == 0 );
+
+   ::close( fd );
+
+   if ( !succ )
+   {
+      std::error_code  ec;
+      std::filesystem::remove( tmp_path, ec );
+      return false;
+   }
+
+   std::filesystem::rename( tmp_path, path );
+
+   return omp_index_open( path );
+}
+
+
+
+/**
+ * 将按 k 排序的 items 与当前索引合并
+ */
+bool omp_index_merge( const std::filesystem::path &path, std::vector< omp_item > &items )
+{
+   return index_write( path, items, true );
+}
+
+
+
+/**
+ * 只用 items 重写索引, 丢弃当前索引中的内容
+ */
+bool omp_index_rewrite( const std::filesystem::path &path, std::vector< omp_item > &items )
+{
+   return index_write( path, items, false );
+}
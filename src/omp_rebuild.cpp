@@ -0,0 +1,348 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "common.h"
+
+
+
+/**
+ * 从本地仓库中的密文对象重建 omp
+ *
+ * 压缩层的开头保存了原对象 oid 的前 16 字节和原对象的长度, 结尾保存了 oid 的后 4 字节 (见 crypto.cpp),
+ * 所以只需解密密文的首尾几块, 即可得到原对象的 oid, 不需要完整解密和解压缩
+ *
+ * 得到的 oid 在本地存在, 且类型, 长度都与密文中记录的一致时, 才认为是一个映射
+ *
+ * 密文对象的判断:
+ *    commit   使用固定的 xcrypt_author, 正文是 base64 的密文
+ *    tree     最后一项的模式是 100664, 指向保存树自身密文的 blob
+ *    blob     长度是 16 的倍数, 且不小于 48
+ *
+ * 对象库中的对象分给多个线程并行扫描, 最后在主线程中写入 omp
+ */
+
+
+
+namespace
+{
+   struct Omp_found
+   {
+      git_oid  plain;
+      git_oid  cipher;
+   };
+}
+
+
+
+/**
+ * 解密首尾, 得到原对象的 oid 和长度
+ */
+bool parse_edge( git_oid &plain, size_t &size, const uint8_t *data, size_t len )
+{
+   uint8_t  head[32];
+   uint8_t  tail[16];
+
+   if ( !aes_decrypt_edge( head, tail, data, len ) )
+      return false;
+
+   if ( head[16] > 7 )
+      return false;
+
+   for ( size_t i = 4; i < 16; ++i )
+   {
+      if ( tail[i] != 0 )
+         return false;
+   }
+
+   size = 0;
+   for ( size_t i = 0; i <= head[16]; ++i )
+      size |= static_cast< size_t >( head[17+i] ) << ( i * 8 );
+
+   uint8_t  raw[GIT_OID_RAWSZ];
+   memcpy( raw, head, 16 );
+   memcpy( raw + 16, tail, GIT_OID_RAWSZ - 16 );
+
+   git_oid_fromraw( &plain, raw );
+   return true;
+}
+
+
+
+/**
+ * 取出加密 commit 正文中的密文
+ */
+static bool commit_cipher( std::vector< uint8_t > &out, std::string_view sv )
+{
+   auto  pos = sv.find( xcrypt_author );
+   if ( pos == sv.npos )
+      return false;
+
+   sv.remove_prefix( pos + sizeof( xcrypt_author ) - 1 );
+
+   out.resize( boost::beast::detail::base64::decoded_size( sv.size( ) ) );
+   auto  ptr = out.data( );
+
+   while ( sv.size( ) > 64 )
+   {
+      if ( sv[64] != '\n' )
+         return false;
+
+      auto  ret = boost::beast::detail::base64::decode( ptr, sv.data( ), 64 );
+      if ( ret.first != 48 )
+         return false;
+
+      ptr += 48;
+      sv.remove_prefix( 65 );
+   }
+
+   auto  ret = boost::beast::detail::base64::decode( ptr, sv.data( ), sv.size( ) );
+   out.resize( ptr - out.data( ) + ret.first );
+
+   return true;
+}
+
+
+
+/**
+ * 加密 tree 的最后一项, 即保存树自身密文的 blob
+ */
+static bool tree_cipher( git_oid &blob, std::string_view sv )
+{
+   if ( sv.size( ) < ( 7 + 1 + 1 + GIT_OID_RAWSZ ) )
+      return false;
+
+   if ( sv[sv.size( ) - GIT_OID_RAWSZ - 1] != '\0' )
+      return false;
+
+   auto  name = sv.substr( 0, sv.size( ) - GIT_OID_RAWSZ - 1 );
+   auto  sp   = name.rfind( ' ' );
+   if ( ( sp == name.npos ) || ( sp < 6 ) || ( name.substr( sp - 6, 7 ) != "100664 " ) )
+      return false;
+
+   git_oid_fromraw( &blob, reinterpret_cast< const uint8_t * >( sv.data( ) ) + sv.size( ) - GIT_OID_RAWSZ );
+   return true;
+}
+
+
+
+/**
+ * 检查一个对象是否是密文, 是则从密文中得到原对象的 oid, 长度和类型, 不检查原对象是否存在
+ */
+bool omp_cipher_origin( git_oid &plain, size_t &plain_size, git_otype &otype, const git_oid &cipher )
+{
+   size_t     len;
+
+   if ( git_odb_read_header( &len, &otype, odb, &cipher ) != 0 )
+      return false;
+
+   if ( ( otype == GIT_OBJ_BLOB ) && ( ( len < 48 ) || ( ( len % 16 ) != 0 ) ) )
+      return false;
+
+   if ( ( otype != GIT_OBJ_COMMIT ) && ( otype != GIT_OBJ_TREE ) && ( otype != GIT_OBJ_BLOB ) )
+      return false;
+
+   git_odb_object  *obj;
+   if ( git_odb_read( &obj, odb, &cipher ) != 0 )
+      return false;
+
+   std::vector< uint8_t >  buff;
+   const uint8_t          *data = nullptr;
+   size_t                  size = 0;
+   bool                    succ = false;
+
+   switch ( otype )
+   {
+   case GIT_OBJ_COMMIT:
+      if ( commit_cipher( buff, to_sv( obj ) ) )
+      {
+         data = buff.data( );
+         size = buff.size( );
+      }
+      break;
+
+   case GIT_OBJ_TREE:
+      {
+         git_oid  blob;
+         if ( !tree_cipher( blob, to_sv( obj ) ) )
+            break;
+
+         git_odb_object_free( obj );
+         obj = nullptr;
+
+         if ( git_odb_read( &obj, odb, &blob ) != 0 )
+            break;
+
+         if ( git_odb_object_type( obj ) != GIT_OBJ_BLOB )
+            break;
+
+         data = static_cast< const uint8_t * >( git_odb_object_data( obj ) );
+         size = git_odb_object_size( obj );
+      }
+      break;
+
+   default:
+      data = static_cast< const uint8_t * >( git_odb_object_data( obj ) );
+      size = git_odb_object_size( obj );
+      break;
+   }
+
+   if ( data != nullptr )
+      succ = parse_edge( plain, plain_size, data, size );
+
+   if ( obj != nullptr )
+      git_odb_object_free( obj );
+
+   return succ;
+}
+
+
+
+/**
+ * 检查一个对象是否是密文, 且对应的原对象在本地存在
+ */
+static bool scan_object( git_oid &plain, const git_oid &cipher )
+{
+   size_t     size;
+   git_otype  otype;
+
+   if ( !omp_cipher_origin( plain, size, otype, cipher ) )
+      return false;
+
+   size_t     plain_size;
+   git_otype  plain_type;
+
+   return ( git_odb_read_header( &plain_size, &plain_type, odb, &plain ) == 0 )
+       && ( plain_type == otype ) && ( plain_size == size );
+}
+
+
+
+static int collect_oid( const git_oid *oid, void *payload )
+{
+   static_cast< Oid_vec * >( payload )->emplace_back( *oid );
+   return 0;
+}
+
+
+
+/**
+ * 扫描整个对象库, 将找到的映射写入 omp, 返回新增的映射数
+ */
+size_t omp_rebuild( )
+{
+   // 所有对象中, 去掉已经有映射的
+   Oid_vec  all;
+   auto  ret = git_odb_foreach( odb, &collect_oid, &all );
+   git_ensure( ret );
+
+   std::sort( all.begin( ), all.end( ),
+      []( const git_oid &a, const git_oid &b )
+      {
+         return git_oid_cmp( &a, &b ) < 0;
+      } );
+
+   all.erase( std::unique( all.begin( ), all.end( ) ), all.end( ) );
+
+   Oid_vec  oids;
+   for ( auto &oid : all )
+   {
+      if ( omp_find( oid ) == nullptr )
+         oids.emplace_back( oid );
+   }
+
+   all = Oid_vec( );
+
+   trace( "omp rebuild    ", oids.size( ), " objects" );
+
+   // 并行扫描
+   std::atomic< size_t >   next{ };
+   std::atomic< size_t >   done{ };
+
+   auto  n = std::max( 1u, std::thread::hardware_concurrency( ) );
+
+   std::vector< std::vector< Omp_found > >   found( n );
+   std::vector< std::thread >                threads;
+
+   for ( unsigned t = 0; t < n; ++t )
+   {
+      threads.emplace_back( [&oids, &next, &done, &out = found[t]]( )
+         {
+            static constexpr size_t  STEP = 64;
+
+            while ( true )
+            {
+               auto  begin = next.fetch_add( STEP );
+               if ( begin >= oids.size( ) )
+                  break;
+
+               auto  end = std::min( begin + STEP, oids.size( ) );
+
+               for ( auto i = begin; i < end; ++i )
+               {
+                  git_oid  plain;
+                  if ( scan_object( plain, oids[i] ) )
+                     out.emplace_back( plain, oids[i] );
+               }
+
+               done += end - begin;
+            }
+         } );
+   }
+
+   while ( done < oids.size( ) )
+   {
+      progress( PROG_SCAN, done, oids.size( ) );
+      std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+   }
+
+   for ( auto &t : threads )
+      t.join( );
+
+   if ( !oids.empty( ) )
+   {
+      progress( PROG_SCAN, oids.size( ), oids.size( ) );
+      progress_end_line( );
+   }
+
+   // 写入 omp
+   size_t  count = 0;
+
+   for ( auto &v : found )
+   {
+      for ( auto &[plain, cipher] : v )
+      {
+         auto  pair = omp_find( plain );
+         if ( pair != nullptr )
+         {
+            if ( !( pair->other( plain ) == cipher ) )
+               trace( "omp conflict   ", plain, " ", cipher );
+
+            continue;
+         }
+
+         trace( "omp rebuild    ", plain, " ", cipher );
+
+         omp_insert( plain, cipher );
+         ++count;
+      }
+   }
+
+   return count;
+}
@@ -0,0 +1,128 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+
+
+
+/**
+ * 保存在远程仓库中的 omp 快照
+ *
+ * 远程的 refs/xcrypt/omp 指向快照提交链, 每次推送追加一个提交, 其父提交为上一个快照提交
+ * 提交的树由若干加密的 blob 组成, 每个 blob 是用 aes_seal 加密的 omp_item 数组 (k 为明文, v 为密文),
+ * 保存本次推送中加密或用到的全部映射
+ *
+ * 本地以 refs/xcrypt/remotes/<remote>/xcrypt/omp 记录已导入的快照, 拉取时只导入其后的提交
+ *
+ * 已有明文历史的新机器导入快照后, 拉取时不必解密, 推送时不必加密
+ */
+
+
+
+/**
+ * 每个 blob 中的映射数
+ */
+static constexpr size_t  SNAPSHOT_CHUNK = 64 * 1024;
+
+
+
+/**
+ * 将本次运行中加密或用到的映射写成快照提交, 没有映射时返回 false
+ */
+bool omp_snapshot_build( git_oid &commit, const git_oid *parent )
+{
+   std::vector< omp_item >  items;
+   omp_visited( items );
+
+   if ( items.empty( ) )
+      return false;
+
+   Tree_entries   entries;
+   char           name[16];
+
+   for ( size_t i = 0; i < items.size( ); i += SNAPSHOT_CHUNK )
+   {
+      auto  n = std::min( SNAPSHOT_CHUNK, items.size( ) - i );
+
+      snprintf( name, sizeof( name ), "%06zu", i / SNAPSHOT_CHUNK );
+      entries.emplace_back( name, write_sealed( items.data( ) + i, n * sizeof( omp_item ) ) );
+   }
+
+   commit = write_commit( write_tree( entries ), parent, "xcrypt omp\n" );
+
+   trace( "omp snapshot   ", items.size( ), " ", commit );
+
+   return true;
+}
+
+
+
+/**
+ * 导入快照提交链中 known 之后的提交, known 为 nullptr 时导入全部
+ */
+void omp_snapshot_import( const git_oid &head, const git_oid *known )
+{
+   size_t   count = 0;
+   git_oid  oid   = head;
+
+   while ( ( known == nullptr ) || !( oid == *known ) )
+   {
+      Tree_entries  entries;
+      read_tree( entries, get_commit_tree( oid ) );
+
+      for ( auto &e : entries )
+      {
+         git_odb_object  *obj;
+         auto  ret = git_odb_read( &obj, odb, &e.second );
+         git_ensure( ret );
+
+         Memory   buff( git_odb_object_size( obj ) );
+         auto     size = read_sealed( buff, obj );
+
+         git_odb_object_free( obj );
+
+         ensure( ( size % sizeof( omp_item ) ) == 0 );
+
+         auto  itr = reinterpret_cast< const omp_item * >( static_cast< uint8_t * >( buff ) );
+         auto  end = itr + size / sizeof( omp_item );
+
+         git_oid  k;
+         git_oid  v;
+
+         for ( ; itr < end; ++itr )
+         {
+            omp_import( itr->k.to( k ), itr->v.to( v ) );
+            ++count;
+         }
+      }
+
+      // 父提交
+      git_odb_object  *obj;
+      auto  ret = git_odb_read( &obj, odb, &oid );
+      git_ensure( ret );
+
+      Oid_vec  refs;
+      get_commit_refs( refs, obj );
+      git_odb_object_free( obj );
+
+      if ( refs.size( ) < 2 )
+         break;
+
+      oid = refs[1];
+   }
+
+   trace( "omp import     ", count, " mappings" );
+}
@@ -0,0 +1,454 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+
+
+
+/**
+ * pack 模式
+ *
+ * 推送时, 使用 libgit2 的 packbuilder 将新增的明文对象打成一个普通的 pack (保留 git 自身的 delta 压缩),
+ * 再将 pack 按 PACK_CHUNK 大小切块, 每块用 aes_seal 加密后作为一个 blob 保存,
+ * 所有分块 blob 组成一棵树, 再由一个无父提交的 pack 提交引用, 远程的 refs/xcrypt/packs/<id> 指向该提交
+ *
+ * 远程的分支信息不再以引用的形式存在, 而是保存在加密的清单中, 清单格式为文本, 每行一项:
+ *    xcrypt-manifest 1
+ *    head <refname>
+ *    pack <id>
+ *    ref <oid> <refname>
+ *
+ * 清单加密后作为 blob, 放在清单提交的树中, 清单提交的父提交为上一个清单提交,
+ * 这样并发推送时, 后推送者会因为非快进而被远程拒绝
+ */
+
+
+
+/**
+ * pack 分块大小
+ */
+static constexpr size_t  PACK_CHUNK = 32 * 1024 * 1024;
+
+
+
+static constexpr std::string_view  manifest_magic = "xcrypt-manifest 1";
+
+
+
+git_oid write_sealed( const void *data, size_t size )
+{
+   Memory   buff( size + 32 + 16 );
+
+   auto  sz = aes_seal( buff, static_cast< const uint8_t * >( data ), size );
+
+   git_oid  oid;
+   auto  ret = git_odb_write( &oid, odb, buff, sz, GIT_OBJ_BLOB );
+   git_ensure( ret );
+
+   return oid;
+}
+
+
+
+size_t read_sealed( Memory<> &buff, git_odb_object *obj )
+{
+   auto  sz = aes_unseal( buff, static_cast< const uint8_t * >( git_odb_object_data( obj ) ), git_odb_object_size( obj ) );
+   if ( sz == SIZE_MAX )
+      xcrypt_abort( "sealed blob checksum error" );
+
+   return sz;
+}
+
+
+
+/**
+ * 写入一个只包含 blob 的树, entries 必须已按名称排序
+ */
+git_oid write_tree( const Tree_entries &entries )
+{
+   std::string    text;
+
+   for ( auto &[name, oid] : entries )
+   {
+      text += "100644 ";
+      text += name;
+      text += '\0';
+      text.append( reinterpret_cast< const char * >( oid.id ), GIT_OID_RAWSZ );
+   }
+
+   git_oid  oid;
+   auto  ret = git_odb_write( &oid, odb, text.data( ), text.size( ), GIT_OBJ_TREE );
+   git_ensure( ret );
+
+   return oid;
+}
+
+
+
+/**
+ * 读取 write_tree 写入的树
+ */
+void read_tree( Tree_entries &entries, const git_oid &tree )
+{
+   git_odb_object  *obj;
+
+   auto  ret = git_odb_read( &obj, odb, &tree );
+   git_ensure( ret );
+
+   ensure( git_odb_object_type( obj ) == GIT_OBJ_TREE );
+
+   auto  sv = to_sv( obj );
+
+   while ( !sv.empty( ) )
+   {
+      auto  sp = sv.find( ' ' );
+      ensure( sp != sv.npos );
+
+      auto  nul = sv.find( '\0', sp + 1 );
+      ensure( nul != sv.npos );
+
+      ensure( sv.size( ) >= ( nul + 1 + GIT_OID_RAWSZ ) );
+
+      auto  &e = entries.emplace_back( );
+      e.first = sv.substr( sp + 1, nul - sp - 1 );
+      git_oid_fromraw( &e.second, reinterpret_cast< const uint8_t * >( sv.data( ) ) + nul + 1 );
+
+      sv.remove_prefix( nul + 1 + GIT_OID_RAWSZ );
+   }
+
+   git_odb_object_free( obj );
+}
+
+
+
+git_oid get_commit_tree( const git_oid &commit )
+{
+   git_odb_object  *obj;
+
+   auto  ret = git_odb_read( &obj, odb, &commit );
+   git_ensure( ret );
+
+   ensure( git_odb_object_type( obj ) == GIT_OBJ_COMMIT );
+
+   auto  sv = to_sv( obj );
+   ensure( sv.size( ) >= ( 4 + 1 + GIT_OID_HEXSZ + 1 ) );
+   ensure( sv.starts_with( "tree " ) );
+
+   git_oid  tree;
+   ret = git_oid_fromstrn( &tree, sv.data( ) + 5, GIT_OID_HEXSZ );
+   git_ensure( ret );
+
+   git_odb_object_free( obj );
+
+   return tree;
+}
+
+
+
+git_oid write_commit( const git_oid &tree, const git_oid *parent, const char *message )
+{
+   std::string    text = "tree ";
+   text += tree;
+   text += '\n';
+
+   if ( parent != nullptr )
+   {
+      text += "parent ";
+      text += *parent;
+      text += '\n';
+   }
+
+   text += xcrypt_author;
+   text += message;
+
+   git_oid  oid;
+   auto  ret = git_odb_write( &oid, odb, text.data( ), text.size( ), GIT_OBJ_COMMIT );
+   git_ensure( ret );
+
+   return oid;
+}
+
+
+
+void manifest_load( Manifest &mf, const git_oid &commit )
+{
+   mf = Manifest{ };
+   mf.has_commit = true;
+   mf.commit     = commit;
+
+   Tree_entries  entries;
+   read_tree( entries, get_commit_tree( commit ) );
+
+   ensure( entries.size( ) == 1 );
+   ensure( entries[0].first == "manifest" );
+
+   git_odb_object  *obj;
+   auto  ret = git_odb_read( &obj, odb, &entries[0].second );
+   git_ensure( ret );
+
+   Memory   buff( git_odb_object_size( obj ) );
+   auto     size = read_sealed( buff, obj );
+
+   git_odb_object_free( obj );
+
+   std::string_view  text( reinterpret_cast< const char * >( static_cast< uint8_t * >( buff ) ), size );
+   bool  first = true;
+
+   while ( !text.empty( ) )
+   {
+      auto  lf = text.find( '\n' );
+      ensure( lf != text.npos );
+
+      auto  line = text.substr( 0, lf );
+      text.remove_prefix( lf + 1 );
+
+      if ( first )
+      {
+         if ( line != manifest_magic )
+            xcrypt_abort( "unsupported manifest format" );
+
+         first = false;
+      }
+
+      else if ( line.starts_with( "head " ) )
+         mf.head = line.substr( 5 );
+
+      else if ( line.starts_with( "pack " ) )
+         mf.packs.emplace_back( line.substr( 5 ) );
+
+      else if ( line.starts_with( "ref " ) )
+      {
+         ensure( line.size( ) > ( 4 + GIT_OID_HEXSZ + 1 ) );
+         ensure( line[4 + GIT_OID_HEXSZ] == ' ' );
+
+         git_oid  oid;
+         ret = git_oid_fromstrn( &oid, line.data( ) + 4, GIT_OID_HEXSZ );
+         git_ensure( ret );
+
+         mf.refs.emplace( line.substr( 4 + GIT_OID_HEXSZ + 1 ), oid );
+      }
+
+      // 不认识的行忽略, 便于以后扩展
+   }
+
+   ensure( !first );
+}
+
+
+
+void manifest_store( Manifest &mf )
+{
+   // 清单
+   std::string    text( manifest_magic );
+   text += '\n';
+
+   if ( !mf.head.empty( ) )
+   {
+      text += "head ";
+      text += mf.head;
+      text += '\n';
+   }
+
+   for ( auto &id : mf.packs )
+   {
+      text += "pack ";
+      text += id;
+      text += '\n';
+   }
+
+   for ( auto &[name, oid] : mf.refs )
+   {
+      text += "ref ";
+      text += oid;
+      text += ' ';
+      text += name;
+      text += '\n';
+   }
+
+   auto  blob = write_sealed( text.data( ), text.size( ) );
+   auto  tree = write_tree( { { "manifest", blob } } );
+
+   mf.commit     = write_commit( tree, mf.has_commit ? &mf.commit : nullptr, "xcrypt manifest\n" );
+   mf.has_commit = true;
+}
+
+
+
+static int pack_progress( int stage, uint32_t current, uint32_t total, void *payload )
+{
+   return progress( PROG_ENUMERATE + stage, current, total );
+}
+
+
+
+static int index_progress( const git_transfer_progress *stats, void *payload )
+{
+   return progress( PROG_UNPACK, stats->indexed_objects, stats->total_objects );
+}
+
+
+
+namespace
+{
+   /**
+    * 将 packbuilder 输出的数据流切块, 加密, 写成 blob
+    */
+   class Chunk_writer
+   {
+   public:
+      Chunk_writer( )
+         : _buff( PACK_CHUNK + 32 + 16 )
+      { }
+
+
+      static int append( void *data, size_t size, void *payload )
+      {
+         auto  &self = *static_cast< Chunk_writer * >( payload );
+         auto   ptr  = static_cast< const uint8_t * >( data );
+
+         while ( size > 0 )
+         {
+            auto  n = std::min( size, PACK_CHUNK - self._size );
+            memcpy( self._buff + self._size, ptr, n );
+
+            self._size += n;
+            ptr        += n;
+            size       -= n;
+
+            if ( self._size == PACK_CHUNK )
+               self.flush( );
+         }
+
+         return 0;
+      }
+
+
+      void flush( )
+      {
+         if ( _size == 0 )
+            return;
+
+         _chunks.emplace_back( write_sealed( _buff, _size ) );
+         _size = 0;
+      }
+
+
+      git_oid write_tree( )
+      {
+         flush( );
+
+         Tree_entries  entries;
+         char  name[16];
+
+         for ( size_t i = 0; i < _chunks.size( ); ++i )
+         {
+            snprintf( name, sizeof( name ), "%06zu", i );
+            entries.emplace_back( name, _chunks[i] );
+         }
+
+         return ::write_tree( entries );
+      }
+
+   private:
+      Memory<>    _buff;
+      size_t      _size{ };
+      Oid_vec     _chunks;
+   };
+}
+
+
+
+/**
+ * 将 walk 中的明文对象打包, 加密后写成 pack 提交
+ * 没有需要推送的对象时返回 false
+ */
+bool pack_encrypt( git_oid &commit, git_revwalk *walk )
+{
+   git_packbuilder  *pb;
+
+   auto  ret = git_packbuilder_new( &pb, repo );
+   git_ensure( ret );
+
+   git_packbuilder_set_threads( pb, 0 );
+
+   ret = git_packbuilder_set_callbacks( pb, &pack_progress, nullptr );
+   git_ensure( ret );
+
+   ret = git_packbuilder_insert_walk( pb, walk );
+   git_ensure( ret );
+
+   auto  count = git_packbuilder_object_count( pb );
+   trace( "pack objects   ", count );
+
+   if ( count > 0 )
+   {
+      Chunk_writer   writer;
+
+      ret = git_packbuilder_foreach( pb, &Chunk_writer::append, &writer );
+      git_ensure( ret );
+
+      commit = write_commit( writer.write_tree( ), nullptr, "xcrypt pack\n" );
+   }
+
+   git_packbuilder_free( pb );
+
+   progress_end_line( );
+
+   return count > 0;
+}
+
+
+
+/**
+ * 下载的 pack 解密后, 交给 libgit2 的 indexer 建立索引, 写入本地仓库
+ */
+void pack_decrypt( const git_oid &commit )
+{
+   Tree_entries  entries;
+   read_tree( entries, get_commit_tree( commit ) );
+
+   git_odb_writepack     *wp;
+   git_transfer_progress  stats{ };
+
+   auto  ret = git_odb_write_pack( &wp, plain_odb, &index_progress, nullptr );
+   git_ensure( ret );
+
+   for ( auto &e : entries )
+   {
+      git_odb_object  *obj;
+
+      ret = git_odb_read( &obj, odb, &e.second );
+      git_ensure( ret );
+
+      Memory   buff( git_odb_object_size( obj ) );
+      auto     size = read_sealed( buff, obj );
+
+      git_odb_object_free( obj );
+
+      ret = wp->append( wp, buff, size, &stats );
+      git_ensure( ret );
+   }
+
+   ret = wp->commit( wp, &stats );
+   git_ensure( ret );
+
+   wp->free( wp );
+
+   ret = git_odb_refresh( odb );
+   git_ensure( ret );
+
+   progress_end_line( );
+}
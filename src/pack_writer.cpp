@@ -0,0 +1,411 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/endian/arithmetic.hpp>
+
+#include <zlib.h>
+
+#include "common.h"
+
+
+
+/**
+ * 将新对象直接写成一个 pack, 而不是逐个写成松散对象
+ *
+ * 加密, 解密时每个对象都调用 git_odb_write, 默认的松散对象后端会为每个对象建立一个文件,
+ * 大量对象时, 文件的建立与 fsync 比加密本身还慢, 之后上传或使用时又要全部读回
+ *
+ * 推送时写密文, 放入密文仓库; 拉取时写解密后的明文, 放入主仓库
+ *
+ * pack_writer_begin 之后, odb_write 只计算 oid, 将对象放入队列, 由后台线程压缩并追加到临时 pack 文件,
+ * pack_writer_end 时补上文件头中的对象数和校验和, 交给 libgit2 的 indexer 建立索引, 放入仓库
+ *
+ * 在 pack_writer_end 之前, 写入的对象在对象库中不可见, 调用者不能在此期间读取它们
+ *
+ * 对象之间不做 delta, 明文 pack 需要更小时, 由之后的 git gc 重新打包
+ *
+ * 推送时写出的密文 pack 不直接上传: libgit2 没有上传现有 pack 的接口, git_remote_upload 总是由 packbuilder
+ * 从对象库重新打包, 只是读取一个 pack 中的对象比读取大量松散对象快得多
+ */
+
+
+
+/**
+ * 队列中未写出数据的上限, 超过时 odb_write 等待
+ */
+static constexpr size_t  QUEUE_LIMIT = 64 * 1024 * 1024;
+
+
+
+struct pack_head
+{
+   char                             magic[4];
+   boost::endian::big_uint32_t      version;
+   boost::endian::big_uint32_t      count;
+};
+
+static_assert( sizeof( pack_head ) == 12 );
+
+
+
+namespace
+{
+   class Pack_writer
+   {
+      struct Item
+      {
+         git_otype                  type;
+         std::vector< uint8_t >     data;
+      };
+
+   public:
+      Pack_writer( bool cipher )
+         : _cipher( cipher )
+      {
+         std::filesystem::path  path = git_dir;
+         path /= "objects/pack/tmp_xcrypt_XXXXXX";
+
+         _path = path.string( );
+
+         _fd = ::mkstemp( _path.data( ) );
+         if ( _fd < 0 )
+            xcrypt_abort( "create pack file failed: %s", strerror( errno ) );
+
+         // 文件头, 对象数在结束时补上
+         pack_head  head{ { 'P', 'A', 'C', 'K' }, 2, 0 };
+         write( &head, sizeof( head ) );
+
+         _thread = std::thread( &Pack_writer::run, this );
+      }
+
+
+      ~Pack_writer( )
+      {
+         if ( _fd >= 0 )
+            ::close( _fd );
+
+         ::unlink( _path.c_str( ) );
+      }
+
+
+      void push( const git_oid &oid, const void *data, size_t size, git_otype type )
+      {
+         if ( !_oids.emplace( oid ).second )
+            return;
+
+         std::unique_lock  lock( _mutex );
+
+         _cv_push.wait( lock, [this]{ return ( _queued < QUEUE_LIMIT ) || _queue.empty( ); } );
+
+         auto  ptr = static_cast< const uint8_t * >( data );
+         _queue.emplace_back( type, std::vector< uint8_t >( ptr, ptr + size ) );
+         _queued += size;
+         _total  += size;
+
+         _cv_pop.notify_one( );
+      }
+
+
+      /**
+       * 写完所有对象, 交给 indexer, 返回对象数
+       */
+      size_t finish( )
+      {
+         {
+            std::lock_guard  lock( _mutex );
+            _done = true;
+            _cv_pop.notify_one( );
+         }
+
+         _thread.join( );
+
+         if ( _failed )
+            xcrypt_abort( "write pack file failed" );
+
+         auto  count = _oids.size( );
+         if ( count == 0 )
+            return 0;
+
+         boost::endian::big_uint32_t  n = count;
+         if ( ::pwrite( _fd, &n, sizeof( n ), offsetof( pack_head, count ) ) != sizeof( n ) )
+            xcrypt_abort( "write pack file failed: %s", strerror( errno ) );
+
+         index( );
+
+         return count;
+      }
+
+      bool cipher( ) const
+      {
+         return _cipher;
+      }
+
+
+      /**
+       * 已写入的对象的原始长度之和
+       */
+      size_t size( ) const
+      {
+         return _total;
+      }
+
+   private:
+      void run( )
+      {
+         std::vector< uint8_t >  buff;
+
+         while ( true )
+         {
+            Item  item;
+
+            {
+               std::unique_lock  lock( _mutex );
+
+               _cv_pop.wait( lock, [this]{ return _done || !_queue.empty( ); } );
+
+               if ( _queue.empty( ) )
+                  return;
+
+               item = std::move( _queue.front( ) );
+               _queue.pop_front( );
+               _queued -= item.data.size( );
+
+               _cv_push.notify_one( );
+            }
+
+            if ( !_failed && !append( buff, item ) )
+               _failed = true;
+         }
+      }
+
+
+      bool append( std::vector< uint8_t > &buff, const Item &item )
+      {
+         size_t  size = item.data.size( );
+         auto    bound = compressBound( size );
+
+         buff.resize( 10 + bound );
+
+         // 对象头: 类型与长度
+         auto  out = buff.data( );
+         auto  c   = static_cast< uint8_t >( ( item.type << 4 ) | ( size & 15 ) );
+
+         for ( size >>= 4; size != 0; size >>= 7 )
+         {
+            *out++ = c | 0x80;
+            c = size & 0x7F;
+         }
+
+         *out++ = c;
+
+         // 密文不可压缩, blob 只做 zlib 封装; commit 是 base64 文本, tree 中有文件名, 仍然压缩
+         uLongf  len   = bound;
+         int     level = Z_DEFAULT_COMPRESSION;
+
+         if ( _cipher )
+            level = ( item.type == GIT_OBJ_BLOB ) ? Z_NO_COMPRESSION : Z_BEST_SPEED;
+
+         if ( compress2( out, &len, item.data.data( ), item.data.size( ), level ) != Z_OK )
+            return false;
+
+         return write( buff.data( ), out - buff.data( ) + len );
+      }
+
+
+      bool write( const void *data, size_t size )
+      {
+         auto  ptr = static_cast< const uint8_t * >( data );
+
+         while ( size > 0 )
+         {
+            auto  n = ::write( _fd, ptr, size );
+            if ( n < 0 )
+            {
+               if ( errno == EINTR )
+                  continue;
+
+               return false;
+            }
+
+            ptr  += n;
+            size -= n;
+         }
+
+         return true;
+      }
+
+
+      static int index_progress( const git_transfer_progress *stats, void *payload )
+      {
+         return progress( PROG_WRITE, stats->indexed_objects, stats->total_objects );
+      }
+
+
+      /**
+       * 读回整个文件, 计算校验和, 交给 indexer
+       */
+      void index( )
+      {
+         git_odb_writepack     *wp;
+         git_transfer_progress  stats{ };
+
+         auto  ret = git_odb_write_pack( &wp, _cipher ? odb : plain_odb, &index_progress, nullptr );
+         git_ensure( ret );
+
+         auto  ctx = EVP_MD_CTX_new( );
+         ensure( ctx != nullptr );
+
+         auto  succ = EVP_DigestInit_ex( ctx, EVP_sha1( ), nullptr );
+         ssl_ensure( succ );
+
+         std::vector< uint8_t >  buff( 1024 * 1024 );
+         off_t  offset = 0;
+
+         while ( true )
+         {
+            auto  n = ::pread( _fd, buff.data( ), buff.size( ), offset );
+            if ( n < 0 )
+            {
+               if ( errno == EINTR )
+                  continue;
+
+               xcrypt_abort( "read pack file failed: %s", strerror( errno ) );
+            }
+
+            if ( n == 0 )
+               break;
+
+            offset += n;
+
+            succ = EVP_DigestUpdate( ctx, buff.data( ), n );
+            ssl_ensure( succ );
+
+            ret = wp->append( wp, buff.data( ), n, &stats );
+            git_ensure( ret );
+         }
+
+         uint8_t  md[20];
+         succ = EVP_DigestFinal_ex( ctx, md, nullptr );
+         ssl_ensure( succ );
+
+         EVP_MD_CTX_free( ctx );
+
+         ret = wp->append( wp, md, sizeof( md ), &stats );
+         git_ensure( ret );
+
+         ret = wp->commit( wp, &stats );
+         git_ensure( ret );
+
+         wp->free( wp );
+
+         // 明文写入主仓库, odb 通过 alternates 读取, 需要重新扫描
+         if ( !_cipher )
+         {
+            ret = git_odb_refresh( odb );
+            git_ensure( ret );
+         }
+
+         progress_end_line( );
+      }
+
+   private:
+      bool                 _cipher;
+      std::string          _path;
+      int                  _fd;
+      Oid_set              _oids;
+
+      std::thread                _thread;
+      std::mutex                 _mutex;
+      std::condition_variable    _cv_push;
+      std::condition_variable    _cv_pop;
+      std::deque< Item >         _queue;
+      size_t                     _queued{ };
+      size_t                     _total{ };
+      bool                       _done{ };
+      std::atomic< bool >        _failed{ };
+   };
+}
+
+
+
+static std::unique_ptr< Pack_writer >   pack_writer;
+
+
+
+/**
+ * 之后 odb_write 写入的对象, 都写入同一个 pack, cipher 表示写入的是密文
+ */
+void pack_writer_begin( bool cipher )
+{
+   ensure( pack_writer == nullptr );
+   pack_writer = std::make_unique< Pack_writer >( cipher );
+}
+
+
+
+/**
+ * 结束当前 pack, 建立索引后放入仓库
+ */
+void pack_writer_end( )
+{
+   ensure( pack_writer != nullptr );
+
+   auto  count = pack_writer->finish( );
+   pack_writer.reset( );
+
+   trace( "pack written   ", count, " objects" );
+}
+
+
+
+/**
+ * 当前 pack 中已写入的数据量, 没有 pack 时返回 0
+ */
+size_t pack_writer_size( )
+{
+   return ( pack_writer == nullptr ) ? 0 : pack_writer->size( );
+}
+
+
+
+/**
+ * 写入一个对象, cipher 为 true 时写入密文仓库, 否则写入主仓库
+ */
+void odb_write( git_oid &oid, const void *data, size_t size, git_otype type, bool cipher )
+{
+   if ( pack_writer == nullptr )
+   {
+      auto  ret = git_odb_write( &oid, cipher ? odb : plain_odb, data, size, type );
+      git_ensure( ret );
+      return;
+   }
+
+   ensure( pack_writer->cipher( ) == cipher );
+
+   auto  ret = git_odb_hash( &oid, data, size, type );
+   git_ensure( ret );
+
+   pack_writer->push( oid, data, size, type );
+}
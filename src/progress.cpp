@@ -28,6 +28,7 @@ static std::condition_variable  cv;
 static std::thread              thread;
 static volatile unsigned        prog_state;
 static volatile unsigned        prog_end_line = 2;
+static bool                     prog_quiet;
        volatile uintmax_t       prog_num_1;
        volatile uintmax_t       prog_num_2;
 
@@ -49,6 +50,7 @@ static constexpr Prog_attr prog_attrs[] =
    { "Receiving objects"         },
    { "Unpacking objects"         },
    { "Writing objects"           },
+   { "Scanning objects"          },
 };
 
 
@@ -145,6 +147,15 @@ void progress_init( )
 
 int progress( unsigned new_state, uint64_t new_num_1, uint64_t new_num_2 )
 {
+   if ( prog_quiet )
+   {
+      prog_state = new_state;
+      prog_num_1 = new_num_1;
+      prog_num_2 = new_num_2;
+
+      return 0;
+   }
+
    if ( new_state != prog_state )
       progress_end_line( );
 
@@ -172,6 +183,9 @@ int progress( unsigned new_state, uint64_t new_num_1, uint64_t new_num_2 )
 
 void progress_end_line( )
 {
+   if ( prog_quiet )
+      return;
+
    std::unique_lock< std::mutex >  lock( mutex );
 
    if ( prog_end_line == 0 )
@@ -196,3 +210,15 @@ void progress_exit( )
 
    thread.join( );
 }
+
+
+
+/**
+ * 不再显示进度, 结束显示线程, 之后的 progress 只记录状态与计数, 不再与显示线程同步
+ */
+void progress_quiet( )
+{
+   progress_exit( );
+
+   prog_quiet = true;
+}
@@ -16,13 +16,19 @@
 
 #include "common.h"
 
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
+#include <optional>
 #include <regex>
+#include <set>
+#include <thread>
 #include <typeinfo>
 #include <vector>
 
 #include <fcntl.h>
 #include <termios.h>
+#include <unistd.h>
 
 #include <boost/preprocessor/arithmetic/sub.hpp>
 #include <boost/preprocessor/control/if.hpp>
@@ -30,7 +36,9 @@
 
 
 git_repository   *repo;
+git_repository   *xrepo;
 git_odb          *odb;
+git_odb          *plain_odb;
 
 Password          pw;
 
@@ -40,6 +48,10 @@ const char       *git_dir;
 const char       *remote_name;
 const char       *remote_url;
 
+bool              pack_mode;
+bool              omp_snapshot;
+bool              cloning;
+
 
 std::string       refs_prefix;
 
@@ -188,6 +200,17 @@ static std::string read_password( const std::string_view &prompt )
 
 
 
+/**
+ * 上一次认证成功时使用的证书序号 (等于证书数时为明文密码), 以及输入过的明文密码
+ *
+ * 同一进程中, list, fetch, push 以及分段上传都要各自连接, 之后的连接从成功的证书开始尝试,
+ * 不再依次尝试前面注定失败的证书, 也不再重复输入密码
+ */
+static std::atomic< unsigned >  cred_good;
+static std::string              cred_password;
+
+
+
 /**
  * 需求:
  *  - 该函数会被多次调用；每次返回一个证书(私钥)或明文密码
@@ -246,6 +269,16 @@ static int ssh_cred_acquire( git_cred **cred, const char *url, const char *usern
    // 证书用尽（或不允许 SSH_KEY）后：最后回退到明文密码
    if ( ( ( allowed_types & GIT_CREDTYPE_USERPASS_PLAINTEXT ) != 0 ) && ( idx >= std::size( cred_names ) ) )
    {
+      // 第一次尝试明文密码时, 先使用之前输入过的密码
+      if ( ( idx == std::size( cred_names ) ) && !cred_password.empty( ) )
+      {
+         ++idx;
+
+         auto ret = git_cred_userpass_plaintext_new( cred, username_from_url, cred_password.c_str( ) );
+         if ( ret == 0 )
+            return 0;
+      }
+
       // 如果不是第一次尝试明文密码，则表示已经失败过一次，提示权限被拒绝
       if ( idx != std::size( cred_names ) )
          fprintf( stderr, "Permission denied, please try again.\n" );
@@ -267,6 +300,8 @@ static int ssh_cred_acquire( git_cred **cred, const char *url, const char *usern
       // 读取密码
       std::string  password = read_password( prompt );
 
+      cred_password = password;
+
       auto ret = git_cred_userpass_plaintext_new( cred, username_from_url, password.c_str( ) );
       if ( ret == 0 )
          return 0;
@@ -302,24 +337,61 @@ static int push_transfer_progress( unsigned int current, unsigned int total, siz
 
 
 
+/**
+ * pack 模式下, 清单引用的推送结果
+ */
+static std::optional< std::string >   manifest_status;
+
+
+
+/**
+ * 上传过程中 push_update_ref 对引用的修改
+ */
+static std::unique_ptr< Ref_batch >   push_refs;
+
+
+
 static int push_update_ref( const char *refname, const char *status, void *data )
 {
-   ensure( status == nullptr );
+   // 推送过程中的临时引用, 删除成功后去掉本地的记录
+   if ( std::string_view( refname ).starts_with( "refs/xcrypt/staging/" ) )
+   {
+      if ( status == nullptr )
+         push_refs->remove( get_xcrypt_remote_ref( refname ) );
 
-   output( "ok %s", refname );
+      return 0;
+   }
 
-   // 成功后, 将本地加密引用, 移动到远程加密引用
-   git_reference  *old_ref;
-   git_reference  *new_ref;
+   // pack 模式的内部引用, 不报告给 git, 由 do_push_pack 根据清单的推送结果统一报告
+   if ( std::string_view( refname ).starts_with( "refs/xcrypt/" ) )
+   {
+      if ( strcmp( refname, "refs/xcrypt/manifest" ) == 0 )
+      {
+         if ( status != nullptr )
+            manifest_status = status;
+         else
+            manifest_status.reset( );
+      }
 
-   auto  ret = git_reference_lookup( &old_ref, repo, get_xcrypt_local_ref( refname ).c_str( ) );
-   git_ensure( ret );
+      if ( status != nullptr )
+         return 0;
+   }
+   else
+   {
+      ensure( status == nullptr );
 
-   ret = git_reference_rename( &new_ref, old_ref, get_xcrypt_remote_ref( refname ).c_str( ), 1, nullptr );
+      output( "ok %s", refname );
+   }
+
+   // 成功后, 将本地加密引用, 移动到远程加密引用, 由 push_refs 在上传结束后一起提交
+   auto  local_ref = get_xcrypt_local_ref( refname );
+
+   git_oid  oid;
+   auto  ret = git_reference_name_to_id( &oid, xrepo, local_ref.c_str( ) );
    git_ensure( ret );
 
-   git_reference_free( old_ref );
-   git_reference_free( new_ref );
+   push_refs->set( get_xcrypt_remote_ref( refname ), oid );
+   push_refs->remove( local_ref );
 
    return 0;
 }
@@ -329,12 +401,28 @@ static int push_update_ref( const char *refname, const char *status, void *data
 /**
  * ssh_cred_acquire 函数中, 如果 ~/.ssh 中存在多少证书, 则依次尝试多少次
  * 在每次尝试时, cred_index 会自增
- * 在每次连接开始前, 将 cred_index 重置为 0
+ * 在每次连接开始前, 由 cred_begin 重置为上一次成功的证书, 连接成功后由 cred_end 记录
  */
 static unsigned cred_index;
 
 
 
+static void cred_begin( unsigned &idx )
+{
+   idx = cred_good;
+}
+
+
+
+static void cred_end( unsigned idx )
+{
+   // 没有调用过 ssh_cred_acquire 时 (无需认证) 不记录
+   if ( idx > cred_good )
+      cred_good = idx - 1;
+}
+
+
+
 static constexpr git_remote_callbacks  remote_cb =
 {
    .version                = GIT_REMOTE_CALLBACKS_VERSION,
@@ -375,8 +463,7 @@ static void repo_open( )
    auto  ret = git_repository_open( &repo, git_dir );
    git_ensure( ret );
 
-   ret = git_repository_odb( &odb, repo );
-   git_ensure( ret );
+   xrepo_open( );
 }
 
 
@@ -391,8 +478,7 @@ static void repo_open_cur_dir( )
 
    git_dir = strdup( git_repository_path( repo ) );
 
-   ret = git_repository_odb( &odb, repo );
-   git_ensure( ret );
+   xrepo_open( );
 }
 
 
@@ -425,6 +511,7 @@ FILE *ssh;
 
 static void do_capabilities( )
 {
+   output( "option" );
    output( "fetch" );
    output( "push" );
    output( );
@@ -432,6 +519,93 @@ static void do_capabilities( )
 
 
 
+static bool parse_bool( const std::string_view &value, bool &b )
+{
+   if ( value == "true" )
+      b = true;
+
+   else if ( value == "false" )
+      b = false;
+
+   else
+      return false;
+
+   return true;
+}
+
+
+
+/**
+ * option <name> <value>
+ *
+ * progress            false 时不显示进度, 结束进度显示线程
+ * verbosity           0 表示 --quiet, 同样不显示进度
+ * cloning             true 表示正在克隆
+ * check-connectivity  直接接受, 不输出 connectivity-ok, 连通性仍由 git 自己检查
+ * followtags          不支持标签, 没有需要跟随的标签, 直接接受
+ * depth               浅克隆, 浅拉取的深度, pack 模式不支持
+ * deepen-since        浅克隆, 浅拉取的时间, 值可能含有空格, 取该行剩余的全部内容
+ */
+static void do_option( )
+{
+   if ( ( argv.size( ) < 3 ) || ( ( argv.size( ) > 3 ) && ( argv[1] != "deepen-since" ) ) )
+   {
+      output( "error invalid option" );
+      fflush( stdout );
+      return;
+   }
+
+   auto  &name  = argv[1];
+   auto  &value = argv[2];
+
+   bool  b;
+   bool  ok = true;
+
+   if ( name == "progress" )
+   {
+      ok = parse_bool( value, b );
+      if ( ok && !b )
+         progress_quiet( );
+   }
+
+   else if ( name == "verbosity" )
+   {
+      if ( value == "0" )
+         progress_quiet( );
+   }
+
+   else if ( name == "cloning" )
+      ok = parse_bool( value, cloning );
+
+   else if ( name == "check-connectivity" )
+      ok = parse_bool( value, b );
+
+   else if ( name == "followtags" )
+      ok = parse_bool( value, b );
+
+   else if ( ( name == "depth" ) && !pack_mode )
+      ok = shallow_parse_depth( value );
+
+   else if ( ( name == "deepen-since" ) && !pack_mode )
+      ok = shallow_parse_since( std::string_view( stdin_line ).substr( value.data( ) - stdin_line.data( ) ) );
+
+   else
+   {
+      output( "unsupported" );
+      fflush( stdout );
+      return;
+   }
+
+   if ( ok )
+      output( "ok" );
+   else
+      output( "error invalid value" );
+
+   fflush( stdout );
+}
+
+
+
 static git_transport * connect_fetch( )
 {
    git_transport  *t;
@@ -440,9 +614,10 @@ static git_transport * connect_fetch( )
    git_ensure( ret );
 
 #if LIBGIT2_NUMBER >= 10500
-   cred_index = 0;
+   cred_begin( cred_index );
    ret = t->connect( t, remote_url, GIT_DIRECTION_FETCH, &connect_opts );
    git_ensure( ret );
+   cred_end( cred_index );
 #else
    t->set_callbacks( t, transport_message, nullptr, nullptr, nullptr );
 
@@ -468,7 +643,7 @@ static void do_list_fetch( )
 static void do_list_push( )
 {
    // 连接之前, 重置
-   cred_index = 0;
+   cred_begin( cred_index );
 
 #if LIBGIT2_NUMBER >= 10400
    auto  ret = git_remote_connect_ext( remote, GIT_DIRECTION_PUSH, &connect_opts );
@@ -478,31 +653,18 @@ static void do_list_push( )
    git_ensure( ret );
 #endif
 
+   cred_end( cred_index );
+
    ret = git_remote_ls( &heads, &heads_count, remote );
    git_ensure( ret );
 }
 
 
 
-static void fetch_head( )
+static void download_heads( std::vector< const git_remote_head * > &need_heads )
 {
    int   ret;
 
-   // 收集需要 fetch 的 head
-   std::vector< const git_remote_head * >    need_heads;
-
-   for ( auto h : std::span< const git_remote_head * >( heads, heads_count ) )
-   {
-      if ( git_odb_exists( odb, &h->oid ) )
-         continue;
-
-      // 不下载符号链接
-      if ( h->symref_target != nullptr )
-         continue;
-
-      need_heads.emplace_back( h );
-   }
-
    // 无需下载
    if ( need_heads.empty( ) )
       return;
@@ -516,29 +678,58 @@ static void fetch_head( )
       tp = connect_fetch( );
 
    // 开始下载
-#if LIBGIT2_NUMBER >= 10700
+#if LIBGIT2_NUMBER >= 10800
+   // 密文仓库已经是浅仓库时, 要告诉远程已有的边界
+   Oid_vec  roots;
+   shallow_read( xrepo, roots );
+
+   git_fetch_negotiation  fetch_nego =
+   {
+      .refs              = need_heads.data( ),
+      .refs_len          = need_heads.size( ),
+      .shallow_roots     = roots.data( ),
+      .shallow_roots_len = roots.size( ),
+      .depth             = shallow_depth,
+   };
+
+   ret = tp->negotiate_fetch( tp, xrepo, &fetch_nego );
+#elif LIBGIT2_NUMBER >= 10700
+   // 1.7 设置 depth 后, fetch 会失败, 密文总是完整下载, 浅拉取只减少解密
    git_fetch_negotiation  fetch_nego =
    {
       .refs     = need_heads.data( ),
       .refs_len = need_heads.size( ),
-      // 1.7.2 设置 depth 后, fetch 会失败, 原因不明
-      // .depth    = 1,
    };
 
-   ret = tp->negotiate_fetch( tp, repo, &fetch_nego );
+   ret = tp->negotiate_fetch( tp, xrepo, &fetch_nego );
 #else
-   ret = tp->negotiate_fetch( tp, repo, need_heads.data( ), need_heads.size( ) );
+   ret = tp->negotiate_fetch( tp, xrepo, need_heads.data( ), need_heads.size( ) );
 #endif
    git_ensure( ret );
 
    git_transfer_progress stats;
 #if LIBGIT2_NUMBER >= 10500
-   ret = tp->download_pack( tp, repo, &stats );
+   ret = tp->download_pack( tp, xrepo, &stats );
 #else
-   ret = tp->download_pack( tp, repo, &stats, &transfer_progress, nullptr );
+   ret = tp->download_pack( tp, xrepo, &stats, &transfer_progress, nullptr );
 #endif
    git_ensure( ret );
 
+#if LIBGIT2_NUMBER >= 10800
+   // 与 git_remote_fetch 相同, 只在指定深度时更新密文仓库的边界
+   if ( shallow_depth > 0 )
+   {
+      git_oidarray  out{ };
+
+      ret = tp->shallow_roots( &out, tp );
+      git_ensure( ret );
+
+      shallow_write( xrepo, Oid_vec( out.ids, out.ids + out.count ) );
+
+      git_oidarray_dispose( &out );
+   }
+#endif
+
    if ( tp != ::transport )
    {
       tp->close( tp );
@@ -548,174 +739,971 @@ static void fetch_head( )
 
 
 
-static void decrypt_fetch( )
+/**
+ * xcrypt 自己使用的远程引用, 不是加密的分支, 不报告给 git
+ */
+static bool is_internal_head( const git_remote_head *h )
 {
-   git_revwalk  *walk;
+   return std::string_view( h->name ).starts_with( "refs/xcrypt/" );
+}
+
 
-   auto  ret = git_revwalk_new( &walk, repo );
-   git_ensure( ret );
 
+static const git_remote_head * find_head( const std::string_view &name )
+{
    for ( auto h : std::span< const git_remote_head * >( heads, heads_count ) )
    {
-      ret = git_revwalk_push( walk, &h->oid );
-      git_ensure( ret );
+      if ( name == h->name )
+         return h;
    }
 
-   std::string    glob( "refs/xcrypt/remotes/" );
-   glob += remote_name;
+   return nullptr;
+}
 
-   ret = git_revwalk_hide_glob( walk, glob.c_str( ) );
-   git_ensure( ret );
 
-   decrypt( walk );
 
-   git_revwalk_free( walk );
+/**
+ * 本次 list 中新下载的加密分支, 它们尚未解密的对象都在新下载的 pack 中
+ */
+static std::set< const git_remote_head * >   new_heads;
+
+
+
+/**
+ * 密文是否按深度浅下载
+ */
+static bool shallow_cipher( )
+{
+#if LIBGIT2_NUMBER >= 10800
+   return shallow_depth > 0;
+#else
+   return false;
+#endif
 }
 
 
 
-static void do_list_result( )
+static void fetch_head( )
 {
+   // 收集需要 fetch 的 head
+   std::vector< const git_remote_head * >    need_heads;
+
+   // 加深浅的密文仓库时, 已有的分支也要重新协商
+   bool  deepen = shallow_cipher( ) && ( git_repository_is_shallow( xrepo ) == 1 );
+
    for ( auto h : std::span< const git_remote_head * >( heads, heads_count ) )
    {
-      if ( h->symref_target != nullptr )
-         output( "@%s %s", h->symref_target, h->name );
+      if ( git_odb_exists( odb, &h->oid ) && !( deepen && !is_internal_head( h ) ) )
+         continue;
 
-      else
-      {
-         auto  ref_name = get_xcrypt_remote_ref( h->name );
+      // 不下载符号链接
+      if ( h->symref_target != nullptr )
+         continue;
 
-         git_reference  *ref;
-         auto ret = git_reference_create( &ref, repo, ref_name.c_str( ), &h->oid, 1, nullptr );
-         git_ensure( ret );
-         git_reference_free( ref );
+      // 其他人推送过程中的临时引用
+      if ( std::string_view( h->name ).starts_with( "refs/xcrypt/staging/" ) )
+         continue;
 
-         trace( "xcrypt remote  ", h->oid, " ", ref_name );
+      need_heads.emplace_back( h );
 
-         auto  map = omp_find( h->oid );
-         if ( map == nullptr )
-         {
-            git_oid  oid = h->oid;
-            decrypt( oid );
-            map = omp_find( h->oid );
-            ensure( map != nullptr );
-         }
+      if ( !is_internal_head( h ) )
+         new_heads.emplace( h );
+   }
 
-         char  str[GIT_OID_HEXSZ+1];
-         git_oid_tostr( str, GIT_OID_HEXSZ+1, &map->second );
+   if ( need_heads.empty( ) )
+      return;
 
-         output( "%s %s", str, h->name );
-      }
+   // 只有克隆时 git 才一定请求全部新分支, 普通的 fetch 可能只请求其中一部分 (例如 git fetch origin main),
+   // 而 list 时还不知道请求哪些, 所以不边下载边解密, 由 decrypt_fetch 只解密请求的分支
+   // 请求的正好是全部新分支时, decrypt_fetch 仍按新 pack 中的偏移顺序解密
+   if ( !cloning )
+   {
+      fetch_pack_begin( );
+      return download_heads( need_heads );
    }
 
-   output( );
+   // 浅拉取时, 只有按深度浅下载的 pack 中的对象才全部需要解密, 其他情况由 shallow_decrypt 选取
+   if ( shallow_requested( ) && !( shallow_cipher( ) && ( shallow_since == 0 ) ) )
+      return download_heads( need_heads );
+
+   // 边下载边解密, 剩余的对象由 decrypt_fetch 解密
+   fetch_stream_begin( );
+
+   download_heads( need_heads );
+
+   fetch_stream_end( );
 }
 
 
 
-static void do_list( )
+/**
+ * 从 skipped 中去掉随本次 pack 下载的 omp 快照提交链, 快照不是密文, 也不属于任何分支
+ */
+static void skip_snapshot( Oid_set &skipped )
 {
-   repo_open( );
-
-   auto  ret = git_remote_create_anonymous( &remote, repo, remote_url );
-   git_ensure( ret );
+   auto  h = find_head( "refs/xcrypt/omp" );
+   if ( h == nullptr )
+      return;
 
-   // fetch 没有参数
-   // push  有一个 for-push 的参数
-   // 所以使用 argv.size( ) 来判断是 fetch 还是 push
-   if ( argv.size( ) == 1 )
-      do_list_fetch( );
-   else
-      do_list_push( );
+   git_oid  oid = h->oid;
 
-   fetch_head( );
+   while ( skipped.erase( oid ) != 0 )
+   {
+      git_commit  *commit;
 
-   decrypt_fetch( );
+      auto  ret = git_commit_lookup( &commit, xrepo, &oid );
+      git_ensure( ret );
 
-   do_list_result( );
-}
+      git_tree  *tree;
 
+      ret = git_tree_lookup( &tree, xrepo, git_commit_tree_id( commit ) );
+      git_ensure( ret );
 
+      skipped.erase( *git_commit_tree_id( commit ) );
 
-static void do_fetch( )
-{
-   git_oid  oid;
+      for ( size_t i = 0; i < git_tree_entrycount( tree ); ++i )
+         skipped.erase( *git_tree_entry_id( git_tree_entry_byindex( tree, i ) ) );
 
-   do
-   {
-      auto  ret = git_oid_fromstr( &oid, argv[1].data( ) );
-      git_ensure( ret );
+      git_tree_free( tree );
 
-      ensure( git_odb_exists( odb, &oid ) != 0 );
+      bool  has_parent = git_commit_parentcount( commit ) > 0;
+      if ( has_parent )
+         oid = *git_commit_parent_id( commit, 0 );
 
-   } while ( !read_input( ).empty( ) );
+      git_commit_free( commit );
 
-   output( );
+      if ( !has_parent )
+         break;
+   }
 }
 
 
 
-static constexpr git_push_options  push_opts =
+/**
+ * 解密 git 请求的分支 want, 解密完成后记录到 refs/xcrypt/remotes/<remote>/, 之后的解密以此为界
+ *
+ * want 正好是本次新下载的分支时, 按新 pack 中的偏移顺序解密, 否则从 want 开始 revwalk, 只解密 want 需要的对象
+ * 浅拉取时, 由 shallow_decrypt 按深度或时间选取要解密的提交
+ *
+ * 记录的分支必须已经完整解密, 否则之后的解密以它为界, 缺少的对象再也不会解密:
+ * revwalk 与 shallow_decrypt 递归解密每个对象, 不是密文时中止;
+ * 按 pack 顺序解密时, 协商以本地全部引用为界, 不在 pack 中的对象都已完整解密, 只有 pack 中跳过的对象可能缺少,
+ * 跳过了 omp 快照以外的对象时, 改为从 want 开始 revwalk, 由 revwalk 补全或者中止
+ */
+static void decrypt_fetch( const std::vector< const git_remote_head * > &want )
 {
-   .version    = GIT_PUSH_OPTIONS_VERSION,
-   .callbacks  = remote_cb,
-   .proxy_opts = proxy_opts,
-};
-
+   Oid_vec  oids;
 
+   bool  by_pack = !shallow_requested( ) && fetch_pack_objects( oids ) && ( want.size( ) == new_heads.size( ) ) &&
+      std::all_of( want.begin( ), want.end( ), []( auto h ){ return new_heads.contains( h ); } );
 
-static void do_push( )
-{
-   repo_open( );
+   bool  by_walk = !want.empty( );
 
-   git_revwalk  *walk;
-   auto ret = git_revwalk_new( &walk, repo );
-   git_ensure( ret );
+   if ( shallow_requested( ) )
+   {
+      for ( auto h : want )
+         oids.emplace_back( h->oid );
 
-   std::list< std::tuple< bool, git_oid *, std::string > >    refspec_list;
+      shallow_decrypt( oids );
 
-   std::regex     rgx( "\\+?([^:]*):(.+)" );
-   std::cmatch    m;
+      by_walk = false;
+   }
 
-   do
+   else if ( by_pack )
    {
-      auto  &orig_refspec = argv[1];
-      ensure( std::regex_match( orig_refspec.begin( ), orig_refspec.end( ), m, rgx ) );
+      Oid_set  skipped;
+      decrypt( oids, skipped );
 
-      auto  &m1 = m[1];
-      auto  &m2 = m[2];
+      skip_snapshot( skipped );
 
-      auto  force = orig_refspec.front( ) == '+';
+      if ( !skipped.empty( ) )
+         trace( "pack skipped   ", skipped.size( ), " objects" );
 
-      auto  oid = static_cast< git_oid * >( nullptr );
+      by_walk = !skipped.empty( );
+   }
 
-      if ( m1.length( ) > 0 )
-      {
-         git_object  *obj;
-         auto  ret = git_revparse_single( &obj, repo, m1.str( ).c_str( ) );
-         git_ensure( ret );
+   if ( by_walk )
+   {
+      git_revwalk  *walk;
 
-         oid = new git_oid{ *git_object_id( obj ) };
-         ret = git_revwalk_push( walk, oid );
-         git_ensure( ret );
+      auto  ret = git_revwalk_new( &walk, xrepo );
+      git_ensure( ret );
 
-         git_object_free( obj );
+      for ( auto h : want )
+      {
+         ret = git_revwalk_push( walk, &h->oid );
+         git_ensure( ret );
       }
 
-      auto  &rs = refspec_list.emplace_back( force, oid, m2.first );
-      trace( "push hash      ", ( std::get<0>( rs ) ? "+" : "" ), *std::get<1>( rs ), ":", std::get<2>( rs ) );
+      std::string    glob( "refs/xcrypt/remotes/" );
+      glob += remote_name;
 
-   } while ( !read_input( ).empty( ) );
+      ret = git_revwalk_hide_glob( walk, glob.c_str( ) );
+      git_ensure( ret );
 
-   // 去除远程仓库已有的提交
-   std::string    remote_dir = "refs/remotes/";
-   remote_dir += remote_name;
+      decrypt( walk );
+
+      git_revwalk_free( walk );
+   }
+
+   Ref_batch  batch( xrepo );
+
+   for ( auto h : want )
+   {
+      auto  ref_name = get_xcrypt_remote_ref( h->name );
+
+      batch.set( ref_name, h->oid );
+
+      trace( "xcrypt remote  ", h->oid, " ", ref_name );
+   }
+
+   batch.commit( );
+}
+
+
+
+/**
+ * 推送前的 list 中, 本地没有映射的远程分支
+ *
+ * 远程分支的密文提交若是要推送的提交的祖先, 必然已有映射 (拉取时解密, 或者推送时加密),
+ * 所以推送到这些分支一定不是快进, 不强制时直接拒绝, 提示先 fetch
+ */
+static std::set< std::string, std::less<> >   unknown_heads;
+
+
+
+static void do_list_result( )
+{
+   Oid_vec  oids;
+
+   for ( auto h : std::span< const git_remote_head * >( heads, heads_count ) )
+   {
+      if ( ( h->symref_target == nullptr ) && !is_internal_head( h ) )
+         oids.emplace_back( h->oid );
+   }
+
+   omp_verify( oids );
+
+   for ( auto h : std::span< const git_remote_head * >( heads, heads_count ) )
+   {
+      if ( is_internal_head( h ) )
+         continue;
+
+      if ( h->symref_target != nullptr )
+         output( "@%s %s", h->symref_target, h->name );
+
+      else
+      {
+         auto  map = omp_find( h->oid );
+
+         // 推送前不下载, 不解密, 没有映射的分支报告为未知, 由 do_push 拒绝非强制的推送
+         if ( ( map == nullptr ) && ( direction == GIT_DIRECTION_PUSH ) )
+         {
+            trace( "xcrypt unknown ", h->oid, " ", h->name );
+
+            unknown_heads.emplace( h->name );
+            output( "? %s", h->name );
+            continue;
+         }
+
+         // 只解密提交本身, 得到明文的 oid, 其余对象等 git 请求时再解密
+         if ( map == nullptr )
+         {
+            git_oid  oid = h->oid;
+            decrypt( oid );
+            map = omp_find( h->oid );
+            ensure( map != nullptr );
+         }
+
+         char  str[GIT_OID_HEXSZ+1];
+         git_oid_tostr( str, GIT_OID_HEXSZ+1, &map->other( h->oid ) );
+
+         output( "%s %s", str, h->name );
+      }
+   }
+
+   output( );
+}
+
+
+
+/**
+ * 导入远程 omp 快照中尚未导入的部分, 快照已随其他 head 一起下载
+ */
+static void import_snapshot( )
+{
+   auto  h = find_head( "refs/xcrypt/omp" );
+   if ( h == nullptr )
+      return;
+
+   auto  mark = get_xcrypt_remote_ref( h->name );
+
+   git_oid  known;
+   bool     has_known = git_reference_name_to_id( &known, xrepo, mark.c_str( ) ) == 0;
+
+   if ( has_known && ( known == h->oid ) )
+      return;
+
+   omp_snapshot_import( h->oid, has_known ? &known : nullptr );
+
+   git_reference  *ref;
+   auto ret = git_reference_create( &ref, xrepo, mark.c_str( ), &h->oid, 1, nullptr );
+   git_ensure( ret );
+   git_reference_free( ref );
+}
+
+
+
+/**
+ * pack 模式下的远程清单
+ */
+static Manifest   manifest;
+
+
+
+/**
+ * pack 模式的 list
+ *
+ * 1. 下载清单提交, 解密清单
+ * 2. 下载清单中尚未导入的 pack, 解密后导入本地仓库
+ * 3. 按清单输出远程引用
+ */
+static void list_pack( )
+{
+   manifest = Manifest{ };
+
+   auto  mf_head = find_head( "refs/xcrypt/manifest" );
+   if ( mf_head != nullptr )
+   {
+      std::vector< const git_remote_head * >    need_heads;
+
+      if ( !git_odb_exists( odb, &mf_head->oid ) )
+      {
+         need_heads.emplace_back( mf_head );
+         download_heads( need_heads );
+      }
+
+      manifest_load( manifest, mf_head->oid );
+
+      // 本地已导入的 pack, 以 refs/xcrypt/remotes/<remote>/xcrypt/packs/<id> 记录
+      std::vector< std::pair< std::string, const git_remote_head * > >   new_packs;
+
+      for ( auto &id : manifest.packs )
+      {
+         auto  name = "refs/xcrypt/packs/" + id;
+         auto  mark = get_xcrypt_remote_ref( name.c_str( ) );
+
+         git_oid  oid;
+         if ( git_reference_name_to_id( &oid, xrepo, mark.c_str( ) ) == 0 )
+            continue;
+
+         auto  h = find_head( name );
+         if ( h == nullptr )
+            xcrypt_abort( "pack '%s' is missing on remote", id.c_str( ) );
+
+         new_packs.emplace_back( std::move( mark ), h );
+      }
+
+      need_heads.clear( );
+      for ( auto &[mark, h] : new_packs )
+      {
+         if ( !git_odb_exists( odb, &h->oid ) )
+            need_heads.emplace_back( h );
+      }
+
+      download_heads( need_heads );
+
+      Ref_batch  batch( xrepo );
+
+      for ( auto &[mark, h] : new_packs )
+      {
+         trace( "import pack    ", h->oid, " ", h->name );
+
+         pack_decrypt( h->oid );
+
+         batch.set( mark, h->oid );
+      }
+
+      batch.set( get_xcrypt_remote_ref( mf_head->name ), mf_head->oid );
+      batch.commit( );
+   }
+
+   if ( manifest.refs.contains( manifest.head ) )
+      output( "@%s HEAD", manifest.head.c_str( ) );
+
+   for ( auto &[name, oid] : manifest.refs )
+   {
+      char  str[GIT_OID_HEXSZ+1];
+      git_oid_tostr( str, GIT_OID_HEXSZ+1, &oid );
+
+      output( "%s %s", str, name.c_str( ) );
+   }
+
+   output( );
+}
+
+
+
+static void do_list( )
+{
+   repo_open( );
+
+   auto  ret = git_remote_create_anonymous( &remote, xrepo, remote_url );
+   git_ensure( ret );
+
+   // fetch 没有参数
+   // push  有一个 for-push 的参数
+   // 所以使用 argv.size( ) 来判断是 fetch 还是 push
+   direction = ( argv.size( ) == 1 ) ? GIT_DIRECTION_FETCH : GIT_DIRECTION_PUSH;
+
+   if ( direction == GIT_DIRECTION_FETCH )
+      do_list_fetch( );
+   else
+      do_list_push( );
+
+   if ( pack_mode )
+      return list_pack( );
+
+   // 其他进程可能刚刚解密过同样的对象
+   omp_sync( );
+
+   // 推送只需要已知的远程分支, 其他人新推送的内容留给之后的 fetch 下载解密
+   if ( direction == GIT_DIRECTION_PUSH )
+      return do_list_result( );
+
+   // 克隆时映射批量写入, 对已有仓库的 fetch 仍逐批写日志
+   if ( cloning )
+      omp_bulk_begin( );
+
+   new_heads.clear( );
+
+   fetch_head( );
+
+   import_snapshot( );
+
+   do_list_result( );
+}
+
+
+
+/**
+ * 分支是否已经完整解密过
+ */
+static bool head_decrypted( const git_remote_head *h )
+{
+   git_oid  oid;
+
+   return ( git_reference_name_to_id( &oid, xrepo, get_xcrypt_remote_ref( h->name ).c_str( ) ) == 0 ) && ( oid == h->oid );
+}
+
+
+
+static void do_fetch( )
+{
+   std::vector< git_oid >                    oids;
+   std::vector< const git_remote_head * >    want;
+
+   do
+   {
+      ensure( argv.size( ) >= 2 );
+
+      auto  &oid = oids.emplace_back( );
+      auto  ret = git_oid_fromstr( &oid, argv[1].data( ) );
+      git_ensure( ret );
+
+      if ( pack_mode || ( argv.size( ) < 3 ) )
+         continue;
+
+      auto  h = find_head( argv[2] );
+      if ( ( h != nullptr ) && ( h->symref_target != nullptr ) )
+         h = find_head( h->symref_target );
+
+      ensure( h != nullptr );
+
+      // 浅拉取可能要加深已经解密过的分支
+      if ( ( shallow_requested( ) || !head_decrypted( h ) ) && ( std::find( want.begin( ), want.end( ), h ) == want.end( ) ) )
+         want.emplace_back( h );
+
+   } while ( !read_input( ).empty( ) );
+
+   // 只解密 git 请求的分支
+   if ( !pack_mode )
+      decrypt_fetch( want );
+
+   for ( auto &oid : oids )
+      ensure( git_odb_exists( odb, &oid ) != 0 );
+
+   output( );
+}
+
+
+
+static constexpr git_push_options  push_opts =
+{
+   .version    = GIT_PUSH_OPTIONS_VERSION,
+   .callbacks  = remote_cb,
+   .proxy_opts = proxy_opts,
+};
+
+
+
+/**
+ * 上传, 推送成功的引用由 push_update_ref 记入 push_refs, 上传结束后一起提交
+ */
+static void upload( GitStrArray &arr )
+{
+   push_refs = std::make_unique< Ref_batch >( xrepo );
+
+   cred_begin( cred_index );
+   auto  ret = git_remote_upload( remote, arr, &push_opts );
+   git_ensure( ret );
+
+   push_refs->commit( );
+   push_refs.reset( );
+}
+
+
+
+using Refspec_list = std::list< std::tuple< bool, git_oid *, std::string > >;
+
+
+
+/**
+ * 读取 git 输入的所有 push 命令, 并将要推送的提交加入 walk
+ */
+static void read_push_refspecs( Refspec_list &refspec_list, git_revwalk *walk )
+{
+   std::regex     rgx( "\\+?([^:]*):(.+)" );
+   std::cmatch    m;
+
+   do
+   {
+      auto  &orig_refspec = argv[1];
+      ensure( std::regex_match( orig_refspec.begin( ), orig_refspec.end( ), m, rgx ) );
+
+      auto  &m1 = m[1];
+      auto  &m2 = m[2];
+
+      auto  force = orig_refspec.front( ) == '+';
+
+      if ( !force && ( m1.length( ) > 0 ) && unknown_heads.contains( std::string_view( m2.first, m2.second ) ) )
+      {
+         trace( "push reject    ", orig_refspec );
+
+         output( "error %s fetch first", m2.first );
+         continue;
+      }
+
+      auto  oid = static_cast< git_oid * >( nullptr );
+
+      if ( m1.length( ) > 0 )
+      {
+         git_object  *obj;
+         auto  ret = git_revparse_single( &obj, repo, m1.str( ).c_str( ) );
+         git_ensure( ret );
+
+         oid = new git_oid{ *git_object_id( obj ) };
+         ret = git_revwalk_push( walk, oid );
+         git_ensure( ret );
+
+         git_object_free( obj );
+      }
+
+      auto  &rs = refspec_list.emplace_back( force, oid, m2.first );
+      trace( "push hash      ", ( std::get<0>( rs ) ? "+" : "" ), *std::get<1>( rs ), ":", std::get<2>( rs ) );
+
+   } while ( !read_input( ).empty( ) );
+}
+
+
+
+static void push_pack( )
+{
+   auto  &mf = manifest;
+
+   git_revwalk  *walk;
+   auto ret = git_revwalk_new( &walk, repo );
+   git_ensure( ret );
+
+   Refspec_list   refspec_list;
+   read_push_refspecs( refspec_list, walk );
+
+   // 非强制的推送必须是快进, 否则拒绝, 与 do_push 中远程对加密分支的要求相同
+   bool  rejected = false;
+
+   for ( auto itr = refspec_list.begin( ); itr != refspec_list.end( ); )
+   {
+      auto  &[force, oid, dst] = *itr;
+      auto   old = mf.refs.find( dst );
+
+      if ( force || ( oid == nullptr ) || ( old == mf.refs.end( ) ) || ( old->second == *oid ) ||
+           ( git_graph_descendant_of( repo, oid, &old->second ) == 1 ) )
+      {
+         ++itr;
+         continue;
+      }
+
+      trace( "push reject    ", *oid, ":", dst );
+
+      output( "error %s non-fast-forward", dst.c_str( ) );
+
+      delete oid;
+      itr = refspec_list.erase( itr );
+
+      rejected = true;
+   }
+
+   // 被拒绝的提交不打包
+   if ( rejected )
+   {
+      git_revwalk_free( walk );
+
+      ret = git_revwalk_new( &walk, repo );
+      git_ensure( ret );
+
+      for ( auto &[force, oid, dst] : refspec_list )
+      {
+         if ( oid != nullptr )
+         {
+            ret = git_revwalk_push( walk, oid );
+            git_ensure( ret );
+         }
+      }
+   }
+
+   if ( refspec_list.empty( ) )
+   {
+      git_revwalk_free( walk );
+
+      output( );
+      return;
+   }
+
+   // 去除远程清单中已有的提交
+   for ( auto &[name, oid] : mf.refs )
+   {
+      if ( git_odb_exists( odb, &oid ) )
+      {
+         ret = git_revwalk_hide( walk, &oid );
+         git_ensure( ret );
+      }
+   }
+
+   GitStrArray    arr;
+   std::string    refspec;
+   Ref_batch      batch( xrepo );
+
+   auto  push_ref = [&]( const std::string &name, const git_oid &oid )
+   {
+      auto  local_ref = get_xcrypt_local_ref( name.c_str( ) );
+
+      batch.set( local_ref, oid );
+
+      refspec  = local_ref;
+      refspec += ':';
+      refspec += name;
+
+      trace( "push libgit2   ", refspec );
+      arr.push( std::move( refspec ) );
+   };
+
+   // 打包新对象
+   git_oid  pack;
+   if ( pack_encrypt( pack, walk ) )
+   {
+      std::string  id;
+      id += pack;
+
+      mf.packs.emplace_back( id );
+      push_ref( "refs/xcrypt/packs/" + id, pack );
+   }
+
+   git_revwalk_free( walk );
+
+   // 更新清单, 远程 HEAD 不存在时, 指向第一个推送的引用
+   for ( auto &[force, oid, dst] : refspec_list )
+   {
+      if ( oid == nullptr )
+         mf.refs.erase( dst );
+
+      else
+      {
+         mf.refs.insert_or_assign( dst, *oid );
+         delete oid;
+
+         if ( !mf.refs.contains( mf.head ) )
+            mf.head = dst;
+      }
+   }
+
+   manifest_store( mf );
+   push_ref( "refs/xcrypt/manifest", mf.commit );
+
+   batch.commit( );
+
+   manifest_status.reset( );
+
+   upload( arr );
+
+   for ( auto &rs : refspec_list )
+   {
+      auto  &dst = std::get< 2 >( rs );
+
+      if ( !manifest_status )
+         output( "ok %s", dst.c_str( ) );
+      else
+         output( "error %s %s", dst.c_str( ), manifest_status->c_str( ) );
+   }
+
+   output( );
+}
+
+
+
+/**
+ * 分段上传使用的回调, 只需要认证, 不显示进度
+ */
+static unsigned stage_cred_index;
+
+static constexpr git_push_options  stage_push_opts =
+{
+   .version    = GIT_PUSH_OPTIONS_VERSION,
+   .callbacks  =
+   {
+      .version     = GIT_REMOTE_CALLBACKS_VERSION,
+      .credentials = ssh_cred_acquire,
+      .payload     = &stage_cred_index,
+   },
+   .proxy_opts = proxy_opts,
+};
+
+
+
+namespace
+{
+   /**
+    * 分段上传
+    *
+    * 推送的密文很多时, encrypt 每加密一段, 就将该段最后一个提交的密文上传到远程的临时引用 refs/xcrypt/staging/<id>,
+    * 上传在后台线程中进行, 与之后的加密同时进行, 最后的推送只需上传剩余的密文, 同时删除临时引用
+    *
+    * 后台线程另外打开密文仓库, 使用独立的连接; 上一段尚未上传完时, 只上传最新的一段
+    * 只是尽力而为, 上传失败时, 由最后的推送上传全部密文
+    *
+    * 上传前在 refs/xcrypt/remotes/<remote>/xcrypt/staging/ 中记录临时引用, 删除成功后才去掉记录,
+    * 最后的推送失败或者进程中止时, 由之后的推送删除远程残留的临时引用, 见 stale_staging
+    */
+   class Push_stage
+   {
+   public:
+      Push_stage( )
+      {
+         _name  = "refs/xcrypt/staging/";
+         _name += std::to_string( getpid( ) );
+         _name += '-';
+         _name += std::to_string( time( nullptr ) );
+
+         _thread = std::thread( &Push_stage::run, this );
+      }
+
+
+      void push( const git_oid &cipher )
+      {
+         std::lock_guard  lock( _mutex );
+
+         _next    = cipher;
+         _pending = true;
+
+         _cv.notify_one( );
+      }
+
+
+      /**
+       * 等待正在进行的上传结束, 尚未开始的不再上传, 返回是否有一段上传成功
+       */
+      bool finish( )
+      {
+         {
+            std::lock_guard  lock( _mutex );
+            _done = true;
+            _cv.notify_one( );
+         }
+
+         _thread.join( );
+
+         // 本地的临时引用不再需要
+         git_reference  *ref;
+         if ( git_reference_lookup( &ref, xrepo, get_xcrypt_local_ref( _name.c_str( ) ).c_str( ) ) == 0 )
+         {
+            git_reference_delete( ref );
+            git_reference_free( ref );
+         }
+
+         return _uploaded;
+      }
+
+
+      const std::string & name( ) const
+      {
+         return _name;
+      }
+
+   private:
+      void run( )
+      {
+         while ( true )
+         {
+            git_oid  cipher;
+
+            {
+               std::unique_lock  lock( _mutex );
+
+               _cv.wait( lock, [this]{ return _done || _pending; } );
+
+               if ( _done )
+                  return;
+
+               cipher   = _next;
+               _pending = false;
+            }
+
+            upload( cipher );
+         }
+      }
+
+
+      void upload( const git_oid &cipher )
+      {
+         auto  r = xrepo_reopen( );
+
+         auto  local_ref = get_xcrypt_local_ref( _name.c_str( ) );
+
+         git_reference  *ref;
+         auto  ret = git_reference_create( &ref, r, local_ref.c_str( ), &cipher, 1, nullptr );
+         git_ensure( ret );
+         git_reference_free( ref );
+
+         git_remote  *rmt;
+         ret = git_remote_create_anonymous( &rmt, r, remote_url );
+         git_ensure( ret );
+
+         // 上传失败时远程也可能已经有了临时引用, 所以先记录
+         ret = git_reference_create( &ref, r, get_xcrypt_remote_ref( _name.c_str( ) ).c_str( ), &cipher, 1, nullptr );
+         git_ensure( ret );
+         git_reference_free( ref );
+
+         GitStrArray    arr;
+         arr.push( "+" + local_ref + ":" + _name );
+
+         cred_begin( stage_cred_index );
+         ret = git_remote_upload( rmt, arr, &stage_push_opts );
+
+         if ( ret == 0 )
+         {
+            cred_end( stage_cred_index );
+            _uploaded = true;
+         }
+
+         trace( "push stage     ", cipher, " ", _name, ( ret == 0 ) ? "" : " failed" );
+
+         git_remote_free( rmt );
+         git_repository_free( r );
+      }
+
+   private:
+      std::string                _name;
+      std::thread                _thread;
+      std::mutex                 _mutex;
+      std::condition_variable    _cv;
+      git_oid                    _next{ };
+      bool                       _pending{ };
+      bool                       _done{ };
+      bool                       _uploaded{ };
+   };
+}
+
+
+
+/**
+ * 之前的推送残留在远程的临时引用, 远程仍然通告的加入删除, 已经不存在的只去掉本地的记录
+ * current 为本次推送的临时引用, 由调用者处理
+ */
+static void stale_staging( GitStrArray &arr, Ref_batch &batch, const std::string &current )
+{
+   auto  prefix = get_xcrypt_remote_ref( "refs/xcrypt/staging/" );
+
+   git_reference_iterator  *itr;
+
+   auto  ret = git_reference_iterator_glob_new( &itr, xrepo, ( prefix + "*" ).c_str( ) );
+   git_ensure( ret );
+
+   git_reference  *ref;
+   while ( git_reference_next( &ref, itr ) == 0 )
+   {
+      std::string  name = "refs/xcrypt/staging/";
+      name += git_reference_name( ref ) + prefix.size( );
+
+      git_reference_free( ref );
+
+      if ( name == current )
+         continue;
+
+      if ( find_head( name ) != nullptr )
+      {
+         trace( "push stale     ", name );
+         arr.push( ":" + name );
+      }
+      else
+         batch.remove( get_xcrypt_remote_ref( name.c_str( ) ) );
+   }
+
+   git_reference_iterator_free( itr );
+}
+
+
+
+static void do_push( )
+{
+   repo_open( );
+
+   if ( pack_mode )
+      return push_pack( );
+
+   omp_sync( );
+
+   git_revwalk  *walk;
+   auto ret = git_revwalk_new( &walk, repo );
+   git_ensure( ret );
+
+   Refspec_list   refspec_list;
+   read_push_refspecs( refspec_list, walk );
+
+   // 全部被拒绝
+   if ( refspec_list.empty( ) )
+   {
+      git_revwalk_free( walk );
+
+      output( );
+      return;
+   }
+
+   // 去除远程仓库已有的提交
+   std::string    remote_dir = "refs/remotes/";
+   remote_dir += remote_name;
 
    ret = git_revwalk_hide_glob( walk, remote_dir.c_str( ) );
    git_ensure( ret );
 
-   // 加密
-   encrypt( walk );
+   // 加密, 已加密的部分同时上传
+   std::unique_ptr< Push_stage >  stage;
+
+   encrypt( walk, [&]( const git_oid &cipher )
+   {
+      if ( stage == nullptr )
+         stage = std::make_unique< Push_stage >( );
+
+      stage->push( cipher );
+   } );
 
    //
    git_revwalk_free( walk );
@@ -723,6 +1711,21 @@ static void do_push( )
    //
    GitStrArray    arr;
    std::string    refspec;
+   Ref_batch      batch( xrepo );
+
+   // 删除临时引用, 重新连接, 使远程通告临时引用, libgit2 据此不再上传其中已有的对象
+   if ( ( stage != nullptr ) && stage->finish( ) )
+   {
+      refspec  = ":";
+      refspec += stage->name( );
+
+      trace( "push libgit2   ", refspec );
+      arr.push( std::move( refspec ) );
+
+      git_remote_disconnect( remote );
+   }
+
+   stale_staging( arr, batch, ( stage != nullptr ) ? stage->name( ) : std::string( ) );
 
    for ( auto &rs : refspec_list )
    {
@@ -738,7 +1741,9 @@ static void do_push( )
          auto  omp = omp_find( *oid );
          ensure( omp != nullptr );
 
-         trace( "push encrypt   ", ( std::get<0>( rs ) ? "+" : "" ), omp->second, ":", std::get<2>( rs ) );
+         auto  &cipher = omp->other( *oid );
+
+         trace( "push encrypt   ", ( std::get<0>( rs ) ? "+" : "" ), cipher, ":", std::get<2>( rs ) );
 
          if ( std::get< 0 >( rs ) )
             refspec += '+';
@@ -748,10 +1753,7 @@ static void do_push( )
          refspec += ':';
          refspec += std::get<2>( rs );
 
-         git_reference  *ref;
-         ret = git_reference_create( &ref, repo, local_ref.c_str( ), &omp->second, 1, nullptr );
-         git_ensure( ret );
-         git_reference_free( ref );
+         batch.set( local_ref, cipher );
 
          delete oid;
       }
@@ -760,9 +1762,32 @@ static void do_push( )
       arr.push( std::move( refspec ) );
    }
 
-   cred_index = 0;
-   ret = git_remote_upload( remote, arr, &push_opts );
-   git_ensure( ret );
+   // omp 快照, 以上一个快照为父提交, 远程已被其他人更新时非快进, 本次不更新快照
+   if ( omp_snapshot )
+   {
+      auto  mark = get_xcrypt_remote_ref( "refs/xcrypt/omp" );
+
+      git_oid  parent;
+      bool     has_parent = git_reference_name_to_id( &parent, xrepo, mark.c_str( ) ) == 0;
+
+      git_oid  commit;
+      if ( omp_snapshot_build( commit, has_parent ? &parent : nullptr ) )
+      {
+         auto  local_ref = get_xcrypt_local_ref( "refs/xcrypt/omp" );
+
+         batch.set( local_ref, commit );
+
+         refspec  = local_ref;
+         refspec += ":refs/xcrypt/omp";
+
+         trace( "push libgit2   ", refspec );
+         arr.push( std::move( refspec ) );
+      }
+   }
+
+   batch.commit( );
+
+   upload( arr );
 
    output( );
 }
@@ -781,6 +1806,7 @@ static constexpr std::pair< std::string_view, void (*)( ) >  command_table[] =
    { "capabilities",  &do_capabilities },
    { "fetch",         &do_fetch },
    { "list",          &do_list },
+   { "option",        &do_option },
    { "push",          &do_push },
 };
 
@@ -820,6 +1846,9 @@ int remote_helper( unsigned argc, char **argv )
 
    repo_open( );
 
+   // 运行期间 prune 不能删除密文
+   File_lock  prune_lock( prune_lock_path( ), false );
+
    load_remote( argv[1] );
 
    omp_load( );
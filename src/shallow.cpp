@@ -0,0 +1,361 @@
+﻿/**
+ * Copyright 2026 Xiao Xuanwen <xxw_pc@163.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <unordered_map>
+
+#include "common.h"
+
+
+
+/**
+ * 浅克隆, 浅拉取
+ *
+ * git 以 option depth / deepen-since 传入深度与时间, 解密时从 git 请求的分支开始, 只选取满足条件的提交,
+ * 选取的提交中, 有父提交未被选取的为边界提交, 其明文 oid 写入 .git/shallow, git 将其视为没有父提交
+ *
+ * 密文提交的作者与时间是固定的, 只能按深度浅下载 (libgit2 1.8 以上), 服务端返回的边界记录在密文仓库的 shallow 文件中;
+ * 父提交不在密文仓库中的提交同样是边界
+ */
+
+
+
+/**
+ * git 请求的深度, 0 表示没有指定, --unshallow 时为 0x7fffffff
+ */
+int        shallow_depth;
+
+/**
+ * git 请求的时间, 只解密提交时间不早于此时间的提交, 0 表示没有指定
+ */
+int64_t    shallow_since;
+
+
+
+bool shallow_requested( )
+{
+   return ( shallow_depth > 0 ) || ( shallow_since > 0 );
+}
+
+
+
+bool shallow_parse_depth( std::string_view value )
+{
+   std::string  str( value );
+   char        *end;
+
+   auto  depth = strtol( str.c_str( ), &end, 10 );
+   if ( ( end == str.c_str( ) ) || ( *end != '\0' ) || ( depth <= 0 ) || ( depth > INT_MAX ) )
+      return false;
+
+   shallow_depth = depth;
+
+   return true;
+}
+
+
+
+/**
+ * git 原样传来 --shallow-since 的参数, 支持:
+ *    秒数, 或者 @秒数
+ *    YYYY-MM-DD [HH:MM[:SS]]
+ *    <n> <单位> ago, 单位为 second, minute, hour, day, week, month, year, 可以用 '.' 代替空格
+ */
+bool shallow_parse_since( std::string_view value )
+{
+   if ( ( value.size( ) >= 2 ) && ( value.front( ) == '"' ) && ( value.back( ) == '"' ) )
+      value = value.substr( 1, value.size( ) - 2 );
+
+   if ( value.starts_with( '@' ) )
+      value.remove_prefix( 1 );
+
+   std::string  str( value );
+   char        *end;
+
+   // 秒数
+   auto  t = strtoll( str.c_str( ), &end, 10 );
+   if ( ( end != str.c_str( ) ) && ( *end == '\0' ) )
+   {
+      shallow_since = t;
+      return t > 0;
+   }
+
+   // 日期
+   struct tm   tm{ };
+
+   if ( auto p = strptime( str.c_str( ), "%Y-%m-%d", &tm ); p != nullptr )
+   {
+      if ( ( *p == ' ' ) || ( *p == 'T' ) )
+      {
+         auto  q = strptime( p + 1, "%H:%M:%S", &tm );
+         p = ( q != nullptr ) ? q : strptime( p + 1, "%H:%M", &tm );
+      }
+
+      if ( ( p == nullptr ) || ( *p != '\0' ) )
+         return false;
+
+      tm.tm_isdst   = -1;
+      shallow_since = mktime( &tm );
+
+      return shallow_since > 0;
+   }
+
+   // 相对时间
+   static constexpr std::pair< std::string_view, int64_t >  units[] =
+   {
+      { "second", 1 },
+      { "minute", 60 },
+      { "hour",   60 * 60 },
+      { "day",    24 * 60 * 60 },
+      { "week",   7 * 24 * 60 * 60 },
+      { "month",  30 * 24 * 60 * 60 },
+      { "year",   365 * 24 * 60 * 60 },
+   };
+
+   std::replace( str.begin( ), str.end( ), '.', ' ' );
+
+   long long   n;
+   char        unit[16];
+   int         len = 0;
+
+   if ( ( sscanf( str.c_str( ), "%lld %15s ago%n", &n, unit, &len ) != 2 ) || ( len == 0 ) || ( str[len] != '\0' ) )
+      return false;
+
+   std::string_view  sv( unit );
+   if ( sv.ends_with( 's' ) )
+      sv.remove_suffix( 1 );
+
+   for ( auto &[name, seconds] : units )
+   {
+      if ( sv == name )
+      {
+         shallow_since = time( nullptr ) - n * seconds;
+         return shallow_since > 0;
+      }
+   }
+
+   return false;
+}
+
+
+
+static std::filesystem::path shallow_path( git_repository *r )
+{
+   return std::filesystem::path( git_repository_path( r ) ) / "shallow";
+}
+
+
+
+/**
+ * 读取仓库 r 的 shallow 文件, 文件不存在时为空
+ */
+void shallow_read( git_repository *r, Oid_vec &oids )
+{
+   auto  fp = fopen( shallow_path( r ).c_str( ), "r" );
+   if ( fp == nullptr )
+      return;
+
+   std::string    line;
+
+   while ( get_line( fp, line ) )
+   {
+      if ( line.empty( ) )
+         continue;
+
+      auto  &oid = oids.emplace_back( );
+      auto   ret = git_oid_fromstr( &oid, line.c_str( ) );
+      git_ensure( ret );
+   }
+
+   fclose( fp );
+}
+
+
+
+/**
+ * 重写仓库 r 的 shallow 文件, oids 为空时删除; 先写临时文件再改名, git 读到的总是完整的文件
+ */
+void shallow_write( git_repository *r, Oid_vec oids )
+{
+   std::sort( oids.begin( ), oids.end( ), []( auto &a, auto &b ){ return git_oid_cmp( &a, &b ) < 0; } );
+   oids.erase( std::unique( oids.begin( ), oids.end( ) ), oids.end( ) );
+
+   auto  path = shallow_path( r );
+
+   trace( "shallow        ", oids.size( ), " ", path.native( ) );
+
+   if ( oids.empty( ) )
+   {
+      std::error_code  ec;
+      std::filesystem::remove( path, ec );
+      return;
+   }
+
+   auto  tmp = path;
+   tmp += '.' + std::to_string( getpid( ) );
+
+   auto  fp = fopen( tmp.c_str( ), "w" );
+   ensure( fp != nullptr );
+
+   for ( auto &oid : oids )
+   {
+      char  str[GIT_OID_HEXSZ+1];
+      git_oid_tostr( str, GIT_OID_HEXSZ+1, &oid );
+
+      fputs( str, fp );
+      fputc( '\n', fp );
+   }
+
+   ensure( fclose( fp ) == 0 );
+
+   std::filesystem::rename( tmp, path );
+}
+
+
+
+/**
+ * 密文提交 parent 的深度为 depth 时, 是否选取
+ */
+static bool shallow_take( const git_oid &parent, int depth )
+{
+   if ( ( shallow_depth > 0 ) && ( depth > shallow_depth ) )
+      return false;
+
+   // 密文仓库是浅的
+   if ( !git_odb_exists( odb, &parent ) )
+      return false;
+
+   if ( ( shallow_since > 0 ) && ( decrypt_commit_time( parent ) < shallow_since ) )
+      return false;
+
+   return true;
+}
+
+
+
+/**
+ * 从密文提交 tips 开始广度优先遍历, 选出要解密的提交 commits, 以及其中的边界提交 boundary
+ * tips 自身总是选取, 深度为 1
+ */
+static void shallow_select( Oid_vec &commits, Oid_vec &boundary, const Oid_vec &tips )
+{
+   std::unordered_map< git_oid, int >   depths;
+   Oid_set                              cut;
+   Oid_vec                              refs;
+
+   for ( auto &tip : tips )
+   {
+      if ( depths.emplace( tip, 1 ).second )
+         commits.emplace_back( tip );
+   }
+
+   for ( size_t i = 0; i < commits.size( ); ++i )
+   {
+      auto  oid   = commits[i];
+      auto  depth = depths[oid];
+
+      git_odb_object  *obj;
+
+      auto  ret = git_odb_read( &obj, odb, &oid );
+      git_ensure( ret );
+
+      ensure( git_odb_object_type( obj ) == GIT_OBJ_COMMIT );
+
+      refs.clear( );
+      get_commit_refs( refs, obj );
+
+      git_odb_object_free( obj );
+
+      bool  edge = false;
+
+      // refs[0] 为树
+      for ( auto &parent : refs | std::views::drop( 1 ) )
+      {
+         if ( depths.contains( parent ) )
+            continue;
+
+         if ( cut.contains( parent ) || !shallow_take( parent, depth + 1 ) )
+         {
+            cut.emplace( parent );
+            edge = true;
+            continue;
+         }
+
+         depths.emplace( parent, depth + 1 );
+         commits.emplace_back( parent );
+      }
+
+      if ( edge )
+         boundary.emplace_back( oid );
+   }
+}
+
+
+
+/**
+ * 按 git 请求的深度或时间, 解密密文提交 tips 的部分历史, 并更新 .git/shallow
+ *
+ * 本次解密了全部父提交的旧边界从 shallow 中去掉, 本次的边界加入 shallow
+ */
+void shallow_decrypt( const Oid_vec &tips )
+{
+   if ( tips.empty( ) )
+      return;
+
+   Oid_vec  commits;
+   Oid_vec  boundary;
+
+   shallow_select( commits, boundary, tips );
+
+   trace( "shallow select ", commits.size( ), " commits, ", boundary.size( ), " boundary" );
+
+   decrypt_commits( commits );
+
+   auto  plain = []( const git_oid &cipher ) -> const git_oid &
+   {
+      auto  map = omp_find( cipher );
+      ensure( map != nullptr );
+
+      return map->other( cipher );
+   };
+
+   Oid_set  edge( boundary.begin( ), boundary.end( ) );
+   Oid_set  deepened;
+
+   for ( auto &oid : commits )
+   {
+      if ( !edge.contains( oid ) )
+         deepened.emplace( plain( oid ) );
+   }
+
+   Oid_vec  old;
+   Oid_vec  roots;
+
+   shallow_read( repo, old );
+
+   for ( auto &oid : old )
+   {
+      if ( !deepened.contains( oid ) )
+         roots.emplace_back( oid );
+   }
+
+   for ( auto &oid : boundary )
+      roots.emplace_back( plain( oid ) );
+
+   shallow_write( repo, std::move( roots ) );
+}
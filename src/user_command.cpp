@@ -31,8 +31,7 @@ static void repo_open_cur_dir( )
 
    git_dir = strdup( git_repository_path( repo ) );
 
-   ret = git_repository_odb( &odb, repo );
-   git_ensure( ret );
+   xrepo_open( );
 }
 
 
@@ -43,10 +42,13 @@ static void repo_open_cur_dir( )
       "usage: %s <command> [<args>...]\n"
       "\n"
       "commands:\n"
-      "   add        Add an encrypted remote\n"
-      "   clear      Clear cache files and local refs for an encrypted remote\n"
-      "   clone      Clone an encrypted remote\n"
-      "   remove     Remove an encrypted remote\n",
+      "   add          Add an encrypted remote\n"
+      "   clear        Clear cache files and local refs for an encrypted remote\n"
+      "   clone        Clone an encrypted remote\n"
+      "   gc           Drop unreachable object mappings\n"
+      "   prune        Remove local encrypted objects not needed to talk to the remote\n"
+      "   rebuild-omp  Rebuild the object mapping from local encrypted objects\n"
+      "   remove       Remove an encrypted remote\n",
       grx_name );
 
    _Exit( EXIT_FAILURE );
@@ -139,7 +141,7 @@ def_val:
 /**
  * 删除并清理指定 remote 下匹配 prefix 的 refs
  */
-static void remote_refs( const char *prefix )
+static void remote_refs( git_repository *repo, const char *prefix )
 {
    git_reference_iterator  *itr;
 
@@ -224,6 +226,39 @@ static int do_add( unsigned argc, char **argv )
 
 
 
+/**
+ * 是否还有其他远程使用与 name 相同的密码
+ */
+static bool password_shared( const char *name, const Password &password )
+{
+   git_config  *cfg;
+   auto  ret = git_repository_config_snapshot( &cfg, repo );
+   git_ensure( ret );
+
+   git_strarray  list;
+   ret = git_remote_list( &list, repo );
+   git_ensure( ret );
+
+   bool  shared = false;
+
+   for ( size_t i = 0; !shared && ( i < list.count ); ++i )
+   {
+      if ( strcmp( list.strings[i], name ) == 0 )
+         continue;
+
+      Password  other;
+      if ( get_remote_password( other, cfg, list.strings[i] ) )
+         shared = memcmp( other.md, password.md, sizeof( password.md ) ) == 0;
+   }
+
+   git_strarray_dispose( &list );
+   git_config_free( cfg );
+
+   return shared;
+}
+
+
+
 /**
  * 清除一个分支的缓存文件
  */
@@ -238,17 +273,18 @@ static int do_clear( unsigned argc, char **argv )
    // 1) 检查是否为加密远程
    check_remote_xcrypt( argv[1] );
 
-   // 删除 omp
-   {
-      std::error_code  ec;
-      auto  path = omp_path( );
-      trace( "delete omp : ", path );
-      std::filesystem::remove( omp_path( ), ec );
-      ensure( ec == std::error_code( ) );
-   }
+   // 删除 omp, 按密钥共用的 omp 只在没有其他远程使用同一密码时删除
+   git_config  *cfg;
+   auto  ret = git_repository_config_snapshot( &cfg, repo );
+   git_ensure( ret );
+
+   bool  has_password = get_remote_password( pw, cfg, argv[1] );
+   git_config_free( cfg );
+
+   omp_clear( has_password && !password_shared( argv[1], pw ) );
 
-   remote_refs( "refs/remotes/" );
-   remote_refs( "refs/xcrypt/remotes/" );
+   remote_refs( repo, "refs/remotes/" );
+   remote_refs( xrepo, "refs/xcrypt/remotes/" );
 
    return EXIT_SUCCESS;
 }
@@ -468,6 +504,85 @@ static int do_set( unsigned argc, char **argv )
 
 
 
+/**
+ * 回收 omp 中不可达的映射, --aggressive 时同时删除对应的密文对象
+ */
+static int do_gc( unsigned argc, char **argv )
+{
+   bool  aggressive = ( argc == 3 ) && ( strcmp( argv[2], "--aggressive" ) == 0 );
+
+   if ( ( argc != 2 ) && !aggressive )
+   {
+      fprintf( stderr, "usage: %s gc <remote-name> [--aggressive]\n", grx_name );
+      _Exit( EXIT_FAILURE );
+   }
+
+   check_remote_xcrypt( argv[1] );
+   load_remote( argv[1] );
+
+   omp_load( );
+
+   auto  count = omp_gc( aggressive );
+
+   fprintf( stderr, "%zu mappings dropped\n", count );
+
+   return EXIT_SUCCESS;
+}
+
+
+
+/**
+ * 删除本地不再需要的密文, 映射保留
+ */
+static int do_prune( unsigned argc, char **argv )
+{
+   if ( argc != 2 )
+   {
+      fprintf( stderr, "usage: %s prune <remote-name>\n", grx_name );
+      _Exit( EXIT_FAILURE );
+   }
+
+   check_remote_xcrypt( argv[1] );
+   load_remote( argv[1] );
+
+   omp_load( );
+
+   auto  count = omp_prune( );
+
+   fprintf( stderr, "%zu encrypted objects removed\n", count );
+
+   return EXIT_SUCCESS;
+}
+
+
+
+/**
+ * 从本地的密文对象重建 omp, 用于 omp 丢失或被清除之后, 避免全量的解密和加密
+ */
+static int do_rebuild_omp( unsigned argc, char **argv )
+{
+   if ( argc != 2 )
+   {
+      fprintf( stderr, "usage: %s rebuild-omp <remote-name>\n", grx_name );
+      _Exit( EXIT_FAILURE );
+   }
+
+   check_remote_xcrypt( argv[1] );
+   load_remote( argv[1] );
+
+   omp_load( );
+
+   auto  count = omp_rebuild( );
+
+   omp_store( );
+
+   fprintf( stderr, "%zu mappings recovered\n", count );
+
+   return EXIT_SUCCESS;
+}
+
+
+
 using user_command_callback = int (*)( unsigned, char ** );
 
 
@@ -479,6 +594,9 @@ static constexpr std::pair< std::string_view, user_command_callback >  user_comm
    { "clone",     &do_clone   },
    { "decrypt",   &do_decrypt },
    { "encrypt",   &do_encrypt },
+   { "gc",        &do_gc      },
+   { "prune",     &do_prune   },
+   { "rebuild-omp", &do_rebuild_omp },
    { "remove",    &do_remove  },
    { "set",       &do_set     },
 };
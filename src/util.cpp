@@ -14,6 +14,10 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
 #include "common.h"
 
 #if BOOST_VERSION >= 108600
@@ -69,6 +73,29 @@ bool get_line( FILE *fp, std::string &line )
 
 
 
+File_lock::File_lock( const std::filesystem::path &path, bool exclusive )
+{
+   std::error_code  ec;
+   std::filesystem::create_directory( path.parent_path( ), ec );
+
+   _fd = ::open( path.c_str( ), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+   if ( _fd < 0 )
+      return;
+
+   while ( ( ::flock( _fd, exclusive ? LOCK_EX : LOCK_SH ) != 0 ) && ( errno == EINTR ) )
+      ;
+}
+
+
+
+File_lock::~File_lock( )
+{
+   if ( _fd >= 0 )
+      ::close( _fd );
+}
+
+
+
 int  system( const std::list< std::string > &args )
 {
    ensure( !args.empty( ) );